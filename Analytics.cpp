@@ -0,0 +1,178 @@
+#include "Analytics.h"
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include "test_runner.h"
+
+using namespace std;
+
+optional<BusMetric> ConvertBusMetricFromString(string_view metric_str) {
+  if (metric_str == "stops") {
+	return BusMetric::STOPS;
+  } else if (metric_str == "unique_stops") {
+	return BusMetric::UNIQUE_STOPS;
+  } else if (metric_str == "length") {
+	return BusMetric::LENGTH;
+  } else if (metric_str == "curvature") {
+	return BusMetric::CURVATURE;
+  }
+  return nullopt;
+}
+
+namespace {
+
+double GetMetric(const BusStats& stats, BusMetric metric) {
+  switch (metric) {
+	case BusMetric::STOPS:
+	  return stats.stop_count;
+	case BusMetric::UNIQUE_STOPS:
+	  return stats.unique_stop_count;
+	case BusMetric::LENGTH:
+	  return stats.route_distance;
+	case BusMetric::CURVATURE:
+	  return stats.curvature;
+	default:
+	  return 0;
+  }
+}
+
+}
+
+StatsIndex::StatsIndex(const RouteManager& rm, size_t thread_count) {
+  const launch policy = thread_count > 1 ? launch::async : launch::deferred;
+  vector<future<void>> tasks;
+
+  for (size_t i = 0; i < buses_by_metric.size(); ++i) {
+	tasks.push_back(async(policy, [this, &rm, i] {
+	  const BusMetric metric = static_cast<BusMetric>(i);
+	  vector<BusEntry>& entries = buses_by_metric[i];
+	  entries.reserve(rm.GetAllBusStats().size());
+	  for (const auto& [bus_name, stats]: rm.GetAllBusStats()) {
+		const double value = GetMetric(stats, metric);
+		// NaN has no place in the order the queries search
+		if (!isnan(value)) {
+		  entries.push_back({value, bus_name});
+		}
+	  }
+	  sort(begin(entries), end(entries), [](const BusEntry& lhs, const BusEntry& rhs) {
+		return make_pair(lhs.value, lhs.bus_name) < make_pair(rhs.value, rhs.bus_name);
+	  });
+	}));
+  }
+
+  tasks.push_back(async(policy, [this, &rm] {
+	stops_by_degree.reserve(rm.GetStopDataBase().size());
+	for (const auto& [stop_name, stop]: rm.GetStopDataBase()) {
+	  stops_by_degree.push_back({stop.GetBuses().size(), stop_name});
+	}
+	sort(begin(stops_by_degree), end(stops_by_degree), [](const auto& lhs, const auto& rhs) {
+	  return make_pair(rhs.first, lhs.second) < make_pair(lhs.first, rhs.second);
+	});
+  }));
+
+  for (auto& task: tasks) {
+	task.get();
+  }
+}
+
+vector<string_view> StatsIndex::TopBuses(BusMetric metric, size_t k) const {
+  const vector<BusEntry>& entries = GetSorted(metric);
+  k = min(k, entries.size());
+  vector<string_view> result;
+  result.reserve(k);
+  // groups of equal values from the largest, each in ascending name
+  // order as in the other queries
+  for (auto last = end(entries); result.size() < k;) {
+	const double value = prev(last)->value;
+	const auto first = partition_point(begin(entries), last,
+		[value](const BusEntry& entry) { return entry.value < value; });
+	const auto group_end = first + min<size_t>(last - first, k - result.size());
+	for (auto it = first; it != group_end; ++it) {
+	  result.push_back(it->bus_name);
+	}
+	last = first;
+  }
+  return result;
+}
+
+vector<string_view> StatsIndex::BusesInRange(BusMetric metric, double from, double to) const {
+  const vector<BusEntry>& entries = GetSorted(metric);
+  const auto first = partition_point(begin(entries), end(entries),
+	  [from](const BusEntry& entry) { return entry.value < from; });
+  const auto last = partition_point(first, end(entries),
+	  [to](const BusEntry& entry) { return entry.value <= to; });
+  vector<string_view> result;
+  result.reserve(last - first);
+  for (auto it = first; it != last; ++it) {
+	result.push_back(it->bus_name);
+  }
+  return result;
+}
+
+vector<string_view> StatsIndex::StopsServedByMoreThan(size_t bus_count) const {
+  const auto last = partition_point(begin(stops_by_degree), end(stops_by_degree),
+	  [bus_count](const auto& entry) { return entry.first > bus_count; });
+  vector<string_view> result;
+  result.reserve(last - begin(stops_by_degree));
+  for (auto it = begin(stops_by_degree); it != last; ++it) {
+	result.push_back(it->second);
+  }
+  return result;
+}
+
+optional<vector<size_t>> StatsIndex::LengthHistogram(double bucket_width) const {
+  const vector<BusEntry>& entries = GetSorted(BusMetric::LENGTH);
+  if (entries.empty() || !(bucket_width > 0)) {
+	return vector<size_t>();
+  }
+  const double last_bucket = entries.back().value / bucket_width;
+  if (!(last_bucket < MAX_HISTOGRAM_BUCKETS)) {
+	return nullopt;
+  }
+  const size_t bucket_count = static_cast<size_t>(last_bucket) + 1;
+  vector<size_t> result(bucket_count);
+  auto first = begin(entries);
+  for (size_t i = 0; i < bucket_count; ++i) {
+	const double bucket_end = (i + 1) * bucket_width;
+	const auto last = partition_point(first, end(entries),
+		[bucket_end](const BusEntry& entry) { return entry.value < bucket_end; });
+	result[i] = last - first;
+	first = last;
+  }
+  return result;
+}
+
+void TestStatsIndex() {
+  RouteManager manager;
+  manager.SetStopData("Tolstopaltsevo", Coords{55.611087 * 3.1415926535 / 180,
+		37.20829 * 3.1415926535 / 180}, vector<DistanceToStop>({{3900, "Marushkino"}}));
+  manager.SetStopData("Marushkino", Coords{55.595884 * 3.1415926535 / 180,
+		37.209755 * 3.1415926535 / 180}, vector<DistanceToStop>({{9900, "Rasskazovka"}}));
+  manager.SetStopData("Rasskazovka", Coords{55.632761 * 3.1415926535 / 180,
+		37.333324 * 3.1415926535 / 180}, {});
+  manager.SetStopData("Extra stop", Coords{53.632761 * 3.1415926535 / 180,
+		37.333324 * 3.1415926535 / 180}, {});
+  manager.SetBusData<NotCycleRoute>("750", {"Tolstopaltsevo", "Marushkino", "Rasskazovka"});
+  manager.SetBusData<CycleRoute>("828", {"Tolstopaltsevo", "Marushkino", "Tolstopaltsevo"});
+  manager.SetBusData<NotCycleRoute>("14", {"Marushkino", "Rasskazovka"});
+  manager.SetBusData<CycleRoute>("1", {"Extra stop"});
+
+  for (size_t thread_count: {1, 4}) {
+	const StatsIndex index(manager, thread_count);
+	ASSERT_EQUAL(index.TopBuses(BusMetric::LENGTH, 2), vector<string_view>({"750", "14"}));
+	// ties in ascending name order
+	ASSERT_EQUAL(index.TopBuses(BusMetric::STOPS, 10),
+		vector<string_view>({"750", "14", "828", "1"}));
+	ASSERT_EQUAL(index.TopBuses(BusMetric::STOPS, 2), vector<string_view>({"750", "14"}));
+	ASSERT_EQUAL(index.BusesInRange(BusMetric::LENGTH, 7800, 19800),
+		vector<string_view>({"828", "14"}));
+	ASSERT(index.BusesInRange(BusMetric::CURVATURE, 100, 200).empty());
+	ASSERT_EQUAL(index.StopsServedByMoreThan(2), vector<string_view>({"Marushkino"}));
+	ASSERT_EQUAL(index.StopsServedByMoreThan(0),
+		vector<string_view>({"Marushkino", "Rasskazovka", "Tolstopaltsevo", "Extra stop"}));
+	ASSERT_EQUAL(*index.LengthHistogram(10000), vector<size_t>({2, 1, 1}));
+	ASSERT(!index.LengthHistogram(0.01));
+	// the curvature of "1" is NaN
+	ASSERT_EQUAL(index.TopBuses(BusMetric::CURVATURE, 10).size(), 3u);
+  }
+}
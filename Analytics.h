@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "RouteManager.h"
+
+//---------------------Analytics-------------------------------//
+
+enum class BusMetric {
+  STOPS,
+  UNIQUE_STOPS,
+  LENGTH,
+  CURVATURE,
+};
+
+std::optional<BusMetric> ConvertBusMetricFromString(std::string_view metric_str);
+
+// Secondary indexes over the results of the bus phase. Built once after all
+// modify requests are processed; names point into the RouteManager, which
+// must outlive the index and must not be modified afterwards. A bus whose
+// metric is NaN, the curvature of a route of one stop, is left out of the
+// queries on that metric.
+class StatsIndex {
+public:
+  StatsIndex(const RouteManager& rm, size_t thread_count);
+
+  // Buses with the k largest values of the metric, largest first; equal
+  // values in ascending name order, as in the other queries.
+  std::vector<std::string_view> TopBuses(BusMetric metric, size_t k) const;
+
+  // Buses with from <= metric <= to, smallest first.
+  std::vector<std::string_view> BusesInRange(BusMetric metric, double from, double to) const;
+
+  // Stops served by more than bus_count buses, busiest first.
+  std::vector<std::string_view> StopsServedByMoreThan(size_t bus_count) const;
+
+  // Count of buses with route length in [i * bucket_width, (i + 1) * bucket_width),
+  // or nullopt if that takes more than MAX_HISTOGRAM_BUCKETS buckets.
+  std::optional<std::vector<size_t>> LengthHistogram(double bucket_width) const;
+
+  static const size_t MAX_HISTOGRAM_BUCKETS = 1 << 16;
+
+private:
+  struct BusEntry {
+	double value;
+	std::string_view bus_name;
+  };
+
+  const std::vector<BusEntry>& GetSorted(BusMetric metric) const {
+	return buses_by_metric[static_cast<size_t>(metric)];
+  }
+
+  std::array<std::vector<BusEntry>, 4> buses_by_metric;
+  std::vector<std::pair<size_t, std::string_view>> stops_by_degree;
+};
+
+//---------------------Analytics-------------------------------//
+
+//---------------------Tests-----------------------------------//
+void TestStatsIndex();
+//---------------------Tests-----------------------------------//
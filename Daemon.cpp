@@ -0,0 +1,651 @@
+#include "Daemon.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "test_runner.h"
+
+using namespace std;
+
+namespace {
+
+const size_t READ_CHUNK_SIZE = 1 << 16;
+// a connection is read for at most this much per wakeup, so one client
+// cannot hold up the others
+const size_t MAX_READ_PER_WAKEUP = 1 << 20;
+// a longer unterminated line closes the connection
+const size_t MAX_LINE_LENGTH = 1 << 16;
+// while more output than this waits for the client, its connection is
+// not read
+const size_t MAX_PENDING_OUTPUT = 1 << 22;
+const size_t MAX_EVENTS = 256;
+// smaller batches are answered on the event loop thread alone
+const size_t MIN_PARALLEL_BATCH = 64;
+
+void ThrowSystemError(const string& what) {
+  throw runtime_error(what + ": " + strerror(errno));
+}
+
+sockaddr_un MakeAddress(const string& socket_path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+	throw invalid_argument("socket path " + socket_path + " is too long");
+  }
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+  return address;
+}
+
+int ConnectTo(const string& socket_path) {
+  if (socket_path.size() >= sizeof(sockaddr_un::sun_path)) {
+	return -1;
+  }
+  const sockaddr_un address = MakeAddress(socket_path);
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+	return -1;
+  }
+  if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+	close(fd);
+	return -1;
+  }
+  return fd;
+}
+
+bool WriteAll(int fd, string_view data) {
+  while (!data.empty()) {
+	const ssize_t written = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+	if (written < 0) {
+	  if (errno == EINTR) {
+		continue;
+	  }
+	  return false;
+	}
+	data.remove_prefix(written);
+  }
+  return true;
+}
+
+// Runs one job on every worker, the calling thread being worker 0, and
+// returns when all of them are done. Threads are started once and reused
+// for every batch.
+class WorkerPool {
+public:
+  explicit WorkerPool(size_t workers_count) {
+	for (size_t worker = 1; worker < workers_count; ++worker) {
+	  threads.emplace_back([this, worker] { Work(worker); });
+	}
+  }
+
+  ~WorkerPool() {
+	{
+	  lock_guard<mutex> lock(m);
+	  stopping = true;
+	}
+	job_ready.notify_all();
+	for (thread& t: threads) {
+	  t.join();
+	}
+  }
+
+  size_t Size() const {
+	return threads.size() + 1;
+  }
+
+  void Run(const function<void(size_t)>& job) {
+	{
+	  lock_guard<mutex> lock(m);
+	  current_job = &job;
+	  busy_count = threads.size();
+	  ++generation;
+	}
+	job_ready.notify_all();
+	job(0);
+	unique_lock<mutex> lock(m);
+	job_done.wait(lock, [this] { return busy_count == 0; });
+	current_job = nullptr;
+  }
+
+private:
+  void Work(size_t worker) {
+	size_t seen_generation = 0;
+	while (true) {
+	  const function<void(size_t)>* job;
+	  {
+		unique_lock<mutex> lock(m);
+		job_ready.wait(lock, [&] { return stopping || generation != seen_generation; });
+		if (stopping) {
+		  return;
+		}
+		seen_generation = generation;
+		job = current_job;
+	  }
+	  (*job)(worker);
+	  lock_guard<mutex> lock(m);
+	  if (--busy_count == 0) {
+		job_done.notify_one();
+	  }
+	}
+  }
+
+  mutex m;
+  condition_variable job_ready, job_done;
+  vector<thread> threads;
+  const function<void(size_t)>* current_job = nullptr;
+  size_t busy_count = 0;
+  size_t generation = 0;
+  bool stopping = false;
+};
+
+struct Connection {
+  string input;
+  string output;
+  uint32_t events = 0;
+  bool reading_closed = false;
+  bool broken = false;
+  bool touched = false;
+};
+
+struct PendingRequest {
+  int fd;
+  RequestHolder request;
+  string error;
+};
+
+class Daemon {
+public:
+  Daemon(const Visitor& visitor, const DaemonOptions& options)
+	: options(options), pool(max<size_t>(1, options.worker_count)),
+	  visitors(pool.Size(), visitor), outputs(pool.Size()) {
+	for (size_t worker = 0; worker < pool.Size(); ++worker) {
+	  outputs[worker].precision(6);
+	  visitors[worker].SetOutputStream(&outputs[worker]);
+	}
+  }
+
+  ~Daemon() {
+	for (const auto& [fd, connection]: connections) {
+	  close(fd);
+	}
+	for (int fd: {listen_fd, signal_fd, epoll_fd}) {
+	  if (fd >= 0) {
+		close(fd);
+	  }
+	}
+	if (listen_fd >= 0) {
+	  unlink(options.socket_path.c_str());
+	}
+  }
+
+  void Run(const sigset_t& stop_signals) {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+	  ThrowSystemError("epoll_create1");
+	}
+	signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+	  ThrowSystemError("signalfd");
+	}
+	Listen();
+	Watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+	Watch(signal_fd, EPOLLIN, EPOLL_CTL_ADD);
+	if (options.stop_fd >= 0) {
+	  Watch(options.stop_fd, EPOLLIN, EPOLL_CTL_ADD);
+	}
+
+	vector<epoll_event> events(MAX_EVENTS);
+	while (true) {
+	  const int ready = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+	  if (ready < 0) {
+		if (errno == EINTR) {
+		  continue;
+		}
+		ThrowSystemError("epoll_wait");
+	  }
+	  for (int i = 0; i < ready; ++i) {
+		const int fd = events[i].data.fd;
+		if (fd == signal_fd || fd == options.stop_fd) {
+		  return;
+		} else if (fd == listen_fd) {
+		  Accept();
+		} else {
+		  Connection& connection = connections.at(fd);
+		  if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR) &&
+			  IsReadable(connection)) {
+			ReadFrom(fd, connection);
+		  }
+		  Touch(fd, connection);
+		}
+	  }
+	  AnswerBatch();
+	  FlushTouched();
+	}
+  }
+
+private:
+  void Listen() {
+	const sockaddr_un address = MakeAddress(options.socket_path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+	  ThrowSystemError("socket");
+	}
+	unlink(options.socket_path.c_str());
+	if (bind(listen_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+	  ThrowSystemError("bind " + options.socket_path);
+	}
+	if (listen(listen_fd, SOMAXCONN) < 0) {
+	  ThrowSystemError("listen");
+	}
+  }
+
+  void Watch(int fd, uint32_t events, int operation) {
+	epoll_event event{};
+	event.events = events;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd, operation, fd, &event) < 0) {
+	  ThrowSystemError("epoll_ctl");
+	}
+  }
+
+  // Out of descriptors, the pending connection cannot be taken and the
+  // listen socket stays readable, so it is not watched until one of the
+  // connections closes.
+  void Accept() {
+	while (true) {
+	  const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	  if (fd < 0) {
+		if (errno == EINTR || errno == ECONNABORTED) {
+		  continue;
+		} else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+		  cerr << "daemon: accept: " << strerror(errno) << ", not accepting until a "
+				  "connection closes\n";
+		  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, nullptr);
+		  accepting = false;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		  cerr << "daemon: accept: " << strerror(errno) << '\n';
+		}
+		return;
+	  }
+	  Connection& connection = connections[fd];
+	  connection.events = EPOLLIN | EPOLLRDHUP;
+	  Watch(fd, connection.events, EPOLL_CTL_ADD);
+	}
+  }
+
+  static bool IsReadable(const Connection& connection) {
+	return !connection.reading_closed && connection.output.size() < MAX_PENDING_OUTPUT;
+  }
+
+  void ReadFrom(int fd, Connection& connection) {
+	char buffer[READ_CHUNK_SIZE];
+	for (size_t read_bytes = 0; !connection.reading_closed && read_bytes < MAX_READ_PER_WAKEUP;) {
+	  const ssize_t bytes = read(fd, buffer, sizeof(buffer));
+	  if (bytes > 0) {
+		connection.input.append(buffer, bytes);
+		read_bytes += bytes;
+	  } else if (bytes == 0) {
+		connection.reading_closed = true;
+	  } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		break;
+	  } else if (errno != EINTR) {
+		connection.reading_closed = connection.broken = true;
+	  }
+	}
+
+	size_t line_start = 0;
+	for (size_t line_end; (line_end = connection.input.find('\n', line_start)) != string::npos;
+		line_start = line_end + 1) {
+	  Enqueue(fd, string_view(connection.input).substr(line_start, line_end - line_start));
+	}
+	connection.input.erase(0, line_start);
+	if (connection.input.size() > MAX_LINE_LENGTH) {
+	  // the rest of the line is not read, so the connection is answered
+	  // and closed
+	  Enqueue(fd, connection.input);
+	  connection.input.clear();
+	  connection.reading_closed = true;
+	} else if (connection.reading_closed && !connection.input.empty()) {
+	  Enqueue(fd, connection.input);
+	  connection.input.clear();
+	}
+  }
+
+  void Enqueue(int fd, string_view line) {
+	if (!line.empty() && line.back() == '\r') {
+	  line.remove_suffix(1);
+	}
+	if (line.empty()) {
+	  return;
+	}
+	if (line.size() > MAX_LINE_LENGTH) {
+	  batch.push_back({fd, nullptr, "request is longer than " + to_string(MAX_LINE_LENGTH) +
+		  " bytes"});
+	  return;
+	}
+	PendingRequest pending{fd, ParseRequest(line, false), {}};
+	if (!pending.request) {
+	  pending.error = "unknown request";
+	} else if (pending.request->parse_error) {
+	  pending.error = *pending.request->parse_error;
+	  pending.request = nullptr;
+	} else if (!visitors[0].CanVisit(pending.request->type)) {
+	  pending.error = "request is not served by this daemon";
+	  pending.request = nullptr;
+	}
+	batch.push_back(move(pending));
+  }
+
+  void Touch(int fd, Connection& connection) {
+	if (!connection.touched) {
+	  connection.touched = true;
+	  touched.push_back(fd);
+	}
+  }
+
+  void AnswerBatch() {
+	if (batch.empty()) {
+	  return;
+	}
+	responses.assign(batch.size(), {});
+	const size_t workers_count = batch.size() < MIN_PARALLEL_BATCH ? 1 : pool.Size();
+	auto answer = [this, workers_count](size_t worker) {
+	  if (worker >= workers_count) {
+		return;
+	  }
+	  ostringstream& output = outputs[worker];
+	  const size_t first = batch.size() * worker / workers_count;
+	  const size_t last = batch.size() * (worker + 1) / workers_count;
+	  for (size_t i = first; i < last; ++i) {
+		if (!batch[i].request) {
+		  responses[i] = "error: " + batch[i].error + "\n";
+		  continue;
+		}
+		output.str("");
+		batch[i].request->Accept(visitors[worker]);
+		responses[i] = output.str();
+	  }
+	};
+	if (workers_count == 1) {
+	  answer(0);
+	} else {
+	  pool.Run(answer);
+	}
+	for (size_t i = 0; i < batch.size(); ++i) {
+	  connections.at(batch[i].fd).output += responses[i];
+	}
+	batch.clear();
+  }
+
+  void FlushTouched() {
+	for (int fd: touched) {
+	  Connection& connection = connections.at(fd);
+	  connection.touched = false;
+	  size_t written = 0;
+	  while (!connection.broken && written < connection.output.size()) {
+		const ssize_t bytes = send(fd, connection.output.data() + written,
+			connection.output.size() - written, MSG_NOSIGNAL);
+		if (bytes >= 0) {
+		  written += bytes;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		  break;
+		} else if (errno != EINTR) {
+		  connection.broken = true;
+		}
+	  }
+	  connection.output.erase(0, written);
+
+	  if (connection.broken || (connection.reading_closed && connection.output.empty())) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+		close(fd);
+		connections.erase(fd);
+		if (!accepting) {
+		  accepting = true;
+		  Watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+		}
+		continue;
+	  }
+	  uint32_t events = 0;
+	  if (IsReadable(connection)) {
+		events |= EPOLLIN | EPOLLRDHUP;
+	  }
+	  if (!connection.output.empty()) {
+		events |= EPOLLOUT;
+	  }
+	  if (events != connection.events) {
+		connection.events = events;
+		Watch(fd, events, EPOLL_CTL_MOD);
+	  }
+	}
+	touched.clear();
+  }
+
+  const DaemonOptions& options;
+  WorkerPool pool;
+  vector<Visitor> visitors;
+  vector<ostringstream> outputs;
+  int epoll_fd = -1, signal_fd = -1, listen_fd = -1;
+  bool accepting = true;
+  unordered_map<int, Connection> connections;
+  vector<int> touched;
+  vector<PendingRequest> batch;
+  vector<string> responses;
+};
+
+}
+
+void RunDaemon(const Visitor& visitor, const DaemonOptions& options) {
+  // stop signals are taken from a signalfd, so they must be blocked before
+  // the worker threads start and inherit the mask
+  sigset_t stop_signals, old_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &old_signals);
+  {
+	Daemon daemon(visitor, options);
+	daemon.Run(stop_signals);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+}
+
+bool RunClient(const string& socket_path, istream& in_stream, ostream& out_stream) {
+  const int fd = ConnectTo(socket_path);
+  if (fd < 0) {
+	return false;
+  }
+  thread writer([fd, &in_stream] {
+	string chunk, line;
+	while (getline(in_stream, line)) {
+	  chunk += line;
+	  chunk += '\n';
+	  if (chunk.size() >= READ_CHUNK_SIZE) {
+		WriteAll(fd, chunk);
+		chunk.clear();
+	  }
+	}
+	WriteAll(fd, chunk);
+	shutdown(fd, SHUT_WR);
+  });
+  char buffer[READ_CHUNK_SIZE];
+  ssize_t bytes;
+  while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+	out_stream.write(buffer, bytes);
+  }
+  writer.join();
+  close(fd);
+  return true;
+}
+
+bool RunLoadGenerator(const LoadOptions& options, istream& in_stream, ostream& out_stream) {
+  using Clock = chrono::steady_clock;
+  vector<string> lines;
+  for (string line; getline(in_stream, line);) {
+	if (!line.empty()) {
+	  lines.push_back(move(line));
+	}
+  }
+  if (lines.empty() || options.connections == 0) {
+	return false;
+  }
+
+  atomic<bool> failed = false;
+  vector<vector<double>> latencies(options.connections);
+  const auto start = Clock::now();
+  vector<thread> clients;
+  for (size_t client = 0; client < options.connections; ++client) {
+	clients.emplace_back([&, client] {
+	  const int fd = ConnectTo(options.socket_path);
+	  if (fd < 0) {
+		failed = true;
+		return;
+	  }
+	  const size_t total = options.requests_per_connection;
+	  const size_t depth = max<size_t>(1, options.pipeline_depth);
+	  deque<Clock::time_point> send_times;
+	  string chunk, input;
+	  char buffer[READ_CHUNK_SIZE];
+	  size_t sent = 0, received = 0;
+	  latencies[client].reserve(total);
+	  while (received < total) {
+		chunk.clear();
+		for (; sent < total && sent - received < depth; ++sent) {
+		  chunk += lines[(client * total + sent) % lines.size()];
+		  chunk += '\n';
+		  send_times.push_back(Clock::now());
+		}
+		if (!WriteAll(fd, chunk)) {
+		  failed = true;
+		  break;
+		}
+		const ssize_t bytes = read(fd, buffer, sizeof(buffer));
+		if (bytes <= 0) {
+		  failed = true;
+		  break;
+		}
+		input.append(buffer, bytes);
+		const auto now = Clock::now();
+		size_t line_start = 0;
+		for (size_t line_end; (line_end = input.find('\n', line_start)) != string::npos;
+			line_start = line_end + 1) {
+		  latencies[client].push_back(
+			  chrono::duration<double, micro>(now - send_times.front()).count());
+		  send_times.pop_front();
+		  ++received;
+		}
+		input.erase(0, line_start);
+	  }
+	  close(fd);
+	});
+  }
+  for (thread& client: clients) {
+	client.join();
+  }
+  const double elapsed = chrono::duration<double>(Clock::now() - start).count();
+  if (failed) {
+	return false;
+  }
+
+  vector<double> all;
+  for (const auto& part: latencies) {
+	all.insert(end(all), begin(part), end(part));
+  }
+  sort(begin(all), end(all));
+  auto percentile = [&all](double p) {
+	return all[min(all.size() - 1, static_cast<size_t>(p * all.size()))];
+  };
+  out_stream << "requests: " << all.size() << '\n'
+			 << "connections: " << options.connections << '\n'
+			 << "pipeline depth: " << options.pipeline_depth << '\n'
+			 << "elapsed: " << elapsed << " s\n"
+			 << "throughput: " << all.size() / elapsed << " requests/s\n"
+			 << "latency p50: " << percentile(0.5) << " us\n"
+			 << "latency p99: " << percentile(0.99) << " us\n"
+			 << "latency max: " << all.back() << " us\n";
+  return true;
+}
+
+void TestDaemon() {
+  RouteManager manager;
+  manager.SetStopData("Tolstopaltsevo", Coords{55.611087 * 3.1415926535 / 180,
+		37.20829 * 3.1415926535 / 180}, vector<DistanceToStop>({{3900, "Marushkino"}}));
+  manager.SetStopData("Marushkino", Coords{55.595884 * 3.1415926535 / 180,
+		37.209755 * 3.1415926535 / 180}, vector<DistanceToStop>({{9900, "Rasskazovka"}}));
+  manager.SetStopData("Rasskazovka", Coords{55.632761 * 3.1415926535 / 180,
+		37.333324 * 3.1415926535 / 180}, {});
+  manager.SetBusData<NotCycleRoute>("750", {"Tolstopaltsevo", "Marushkino", "Rasskazovka"});
+  manager.BuildLookupIndex();
+  Visitor visitor;
+  visitor.SetRouteManager(&manager);
+
+  DaemonOptions options;
+  options.socket_path = (filesystem::temp_directory_path() /
+	  ("transport-test-" + to_string(random_device()()) + ".sock")).string();
+  options.worker_count = 2;
+  // Serves the requests of one client and returns its output; a daemon
+  // failing to start fails the test instead of terminating the program.
+  auto serve = [&](const string& requests) {
+	int stop_pipe[2];
+	ASSERT(pipe(stop_pipe) == 0);
+	options.stop_fd = stop_pipe[0];
+	string daemon_error;
+	thread daemon([&] {
+	  try {
+		RunDaemon(visitor, options);
+	  } catch (const exception& e) {
+		daemon_error = e.what();
+	  }
+	});
+	ostringstream output;
+	bool connected = false;
+	for (int attempt = 0; attempt < 100 && !connected && daemon_error.empty(); ++attempt) {
+	  istringstream input(requests);
+	  output.str("");
+	  connected = RunClient(options.socket_path, input, output);
+	  if (!connected) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+	  }
+	}
+	const bool stopped = write(stop_pipe[1], "x", 1) == 1;
+	daemon.join();
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	ASSERT(stopped);
+	ASSERT_EQUAL(daemon_error, "");
+	ASSERT(connected);
+	return output.str();
+  };
+
+  ostringstream expected;
+  string requests;
+  for (int i = 0; i < 100; ++i) {
+	requests += "Bus 750\nStop Marushkino\nBus 751\nHello\nTopBuses length 1\n";
+	expected << "Bus 750: 5 stops on route, 3 unique stops, 27600 route length, "
+				"1.31808 curvature\n"
+			 << "Stop Marushkino: buses 750\n"
+			 << "Bus 751: not found\n"
+			 << "error: unknown request\n"
+			 << "error: request is not served by this daemon\n";
+  }
+  ASSERT_EQUAL(serve(requests), expected.str());
+
+  // a line without an end is cut off instead of being buffered
+  ASSERT_EQUAL(serve("Bus 750\n" + string(MAX_LINE_LENGTH * 4, 'x')),
+	  "Bus 750: 5 stops on route, 3 unique stops, 27600 route length, 1.31808 curvature\n"
+	  "error: request is longer than 65536 bytes\n");
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include "Requests.h"
+
+//---------------------Daemon----------------------------------//
+
+struct DaemonOptions {
+  std::string socket_path;
+  size_t worker_count = 1;
+  // the daemon also stops once this descriptor becomes readable
+  int stop_fd = -1;
+};
+
+struct LoadOptions {
+  std::string socket_path;
+  size_t connections = 4;
+  size_t requests_per_connection = 100000;
+  size_t pipeline_depth = 64;
+};
+
+// Serves read requests over a Unix domain socket until SIGINT, SIGTERM or
+// stop_fd.
+// Each request is one line and gets one response line in the usual format;
+// clients may pipeline any number of requests per connection. Requests
+// queued on all connections during one epoll wakeup are answered as one
+// batch split between worker_count workers, each with its own copy of
+// visitor. Everything visitor reads must stay unmodified while serving.
+void RunDaemon(const Visitor& visitor, const DaemonOptions& options);
+
+// Sends every line of in_stream to the daemon and writes the responses
+// to out_stream. Returns false if the daemon cannot be reached.
+bool RunClient(const std::string& socket_path, std::istream& in_stream,
+		std::ostream& out_stream);
+
+// Replays the lines of in_stream round robin over several pipelined
+// connections and reports throughput and latency percentiles.
+bool RunLoadGenerator(const LoadOptions& options, std::istream& in_stream,
+		std::ostream& out_stream);
+
+//---------------------Daemon----------------------------------//
+
+//---------------------Tests-----------------------------------//
+void TestDaemon();
+//---------------------Tests-----------------------------------//
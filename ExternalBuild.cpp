@@ -0,0 +1,934 @@
+#include "ExternalBuild.h"
+#include <algorithm>
+#include <cstdio>
+#include <queue>
+#include <random>
+#include "Requests.h"
+#include "test_runner.h"
+
+using namespace std;
+
+namespace {
+
+const size_t MAX_FAN_IN = 64;
+const size_t SORTERS_COUNT = 11;
+const size_t MAX_FORMATTED_INDEX = 9999999999;
+
+string FormatDouble(double value) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.17g", value);
+  return buffer;
+}
+
+string FormatIndex(size_t index) {
+  char buffer[24];
+  snprintf(buffer, sizeof(buffer), "%010zu", index);
+  return buffer;
+}
+
+string FormatKind(Diagnostic::Kind kind) {
+  return to_string(static_cast<int>(kind));
+}
+
+template <typename... Fields>
+string MakeRecord(const Fields&... fields) {
+  string record;
+  ((record += fields, record += '\t'), ...);
+  record.pop_back();
+  return record;
+}
+
+string Quote(string_view name) {
+  return "\"" + string(name) + "\"";
+}
+
+// Remembers the coordinates of the stop at the head of a merge stream,
+// which precede every segment record of that stop.
+struct CurrentStop {
+  bool Matches(string_view stop_name) const {
+	return defined && name == stop_name;
+  }
+
+  void Set(string_view stop_name, string_view latitude_, string_view longitude_) {
+	if (Matches(stop_name)) {
+	  return;
+	}
+	defined = true;
+	name = stop_name;
+	latitude = latitude_;
+	longitude = longitude_;
+  }
+
+  bool defined = false;
+  string name, latitude, longitude;
+};
+
+// Reads the lines of a sorted file in order, for joins with a merge
+// stream sorted the same way.
+class SortedFileReader {
+public:
+  explicit SortedFileReader(const filesystem::path& path) : input(path) {
+	Advance();
+  }
+
+  bool HasRecord() const {
+	return has_record;
+  }
+
+  const string& Record() const {
+	return record;
+  }
+
+  void Advance() {
+	has_record = static_cast<bool>(getline(input, record));
+  }
+
+  // Skips the lines before key and says whether key is the next one.
+  bool SkipTo(string_view key) {
+	while (has_record && record < key) {
+	  Advance();
+	}
+	return has_record && record == key;
+  }
+
+private:
+  ifstream input;
+  string record;
+  bool has_record = false;
+};
+
+}
+
+//---------------------ExternalSorter-----------------------------//
+
+ExternalSorter::ExternalSorter(filesystem::path dir_, string name_, size_t memory_limit_)
+  : dir(move(dir_)), name(move(name_)), memory_limit(memory_limit_) {}
+
+ExternalSorter::~ExternalSorter() {
+  for (const auto& run: runs) {
+	error_code ec;
+	filesystem::remove(run, ec);
+  }
+}
+
+void ExternalSorter::Add(string record) {
+  memory_used += record.size() + sizeof(record);
+  buffer.push_back(move(record));
+  if (memory_used >= memory_limit) {
+	Spill();
+  }
+}
+
+void ExternalSorter::Spill() {
+  static size_t runs_created = 0;
+  sort(begin(buffer), end(buffer));
+  runs.push_back(dir / (name + "." + to_string(runs_created++) + ".run"));
+  ofstream out(runs.back());
+  for (const string& record: buffer) {
+	out << record << '\n';
+  }
+  buffer.clear();
+  memory_used = 0;
+}
+
+void ExternalSorter::Merge(const function<void(string_view)>& callback) {
+  if (runs.empty()) {
+	sort(begin(buffer), end(buffer));
+	for (const string& record: buffer) {
+	  callback(record);
+	}
+	buffer.clear();
+	memory_used = 0;
+	return;
+  }
+  if (!buffer.empty()) {
+	Spill();
+  }
+  while (runs.size() > MAX_FAN_IN) {
+	const filesystem::path merged = MergeRuns(0, MAX_FAN_IN);
+	runs.erase(begin(runs), begin(runs) + MAX_FAN_IN);
+	runs.push_back(merged);
+  }
+  MergeRuns(0, runs.size(), callback);
+  runs.clear();
+}
+
+filesystem::path ExternalSorter::MergeRuns(size_t first, size_t last) {
+  static size_t merges_created = 0;
+  const filesystem::path merged = dir / (name + ".merge" + to_string(merges_created++) + ".run");
+  ofstream out(merged);
+  MergeRuns(first, last, [&out](string_view record) {
+	out << record << '\n';
+  });
+  return merged;
+}
+
+void ExternalSorter::MergeRuns(size_t first, size_t last,
+		const function<void(string_view)>& callback) {
+  vector<ifstream> inputs;
+  vector<string> heads(last - first);
+  for (size_t i = first; i < last; ++i) {
+	inputs.emplace_back(runs[i]);
+  }
+  auto greater_head = [&heads](size_t lhs, size_t rhs) {
+	return heads[lhs] > heads[rhs];
+  };
+  priority_queue<size_t, vector<size_t>, decltype(greater_head)> queue(greater_head);
+  for (size_t i = 0; i < inputs.size(); ++i) {
+	if (getline(inputs[i], heads[i])) {
+	  queue.push(i);
+	}
+  }
+  while (!queue.empty()) {
+	const size_t i = queue.top();
+	queue.pop();
+	callback(heads[i]);
+	if (getline(inputs[i], heads[i])) {
+	  queue.push(i);
+	}
+  }
+  inputs.clear();
+  for (size_t i = first; i < last; ++i) {
+	error_code ec;
+	filesystem::remove(runs[i], ec);
+  }
+}
+
+//---------------------ExternalSorter-----------------------------//
+
+//---------------------DiskTable----------------------------------//
+
+DiskTable::DiskTable(filesystem::path path_) : path(move(path_)), writer(path) {}
+
+void DiskTable::Append(string_view key, string_view value) {
+  if (rows_count++ % SPARSE_STEP == 0) {
+	sparse_index.push_back({string(key), offset});
+  }
+  writer << key << '\t' << value << '\n';
+  offset += key.size() + value.size() + 2;
+}
+
+void DiskTable::Finish() {
+  writer.close();
+  reader.open(path);
+}
+
+optional<string> DiskTable::Find(string_view key) const {
+  auto it = upper_bound(begin(sparse_index), end(sparse_index), key,
+	  [](string_view lhs, const auto& rhs) { return lhs < rhs.first; });
+  if (it == begin(sparse_index)) {
+	return nullopt;
+  }
+  reader.clear();
+  reader.seekg(prev(it)->second);
+  string row;
+  for (size_t i = 0; i < SPARSE_STEP && getline(reader, row); ++i) {
+	string_view value = row;
+	const string_view row_key = ReadToken(value, "\t");
+	if (row_key == key) {
+	  return string(value);
+	} else if (row_key > key) {
+	  break;
+	}
+  }
+  return nullopt;
+}
+
+//---------------------DiskTable----------------------------------//
+
+//---------------------ExternalRouteDataBase----------------------//
+
+ExternalRouteDataBase::ExternalRouteDataBase(istream& in_stream,
+		const ExternalBuildOptions& options, size_t& line_number) {
+  work_dir = options.temp_dir / ("transport-" + to_string(random_device()()));
+  filesystem::create_directories(work_dir);
+  const size_t sorter_memory = max<size_t>(1, options.memory_limit / SORTERS_COUNT);
+
+  // stop definitions with their road distances keyed by (stop, line)
+  ExternalSorter stop_defs(work_dir, "stop_defs", sorter_memory);
+  // stop definitions and the definitions giving a road distance to them
+  ExternalSorter stop_targets(work_dir, "stop_targets", sorter_memory);
+  // stop records and route segments keyed by the stop the segment leaves
+  ExternalSorter by_from(work_dir, "by_from", sorter_memory);
+  // stop records and route segments keyed by the stop the segment enters
+  ExternalSorter by_to(work_dir, "by_to", sorter_memory);
+  // road distances and segment lookups keyed by the ordered stop pair
+  ExternalSorter by_pair(work_dir, "by_pair", sorter_memory);
+  // bus headers, unique stop counts, joined segments and failures by
+  // (bus, line) of every bus definition
+  ExternalSorter by_bus(work_dir, "by_bus", sorter_memory);
+  // (bus, line, stop) triples for unique stop counts
+  ExternalSorter bus_stops(work_dir, "bus_stops", sorter_memory);
+  // unique stops and rejections by (bus, line)
+  ExternalSorter definition_stops(work_dir, "definition_stops", sorter_memory);
+  // stop records and (stop, bus) pairs for the stop table
+  ExternalSorter stop_buses(work_dir, "stop_buses", sorter_memory);
+  // (line, order) keyed diagnostics
+  ExternalSorter diagnostics(work_dir, "diagnostics", sorter_memory);
+
+  size_t diagnostics_added = 0;
+  auto add_diagnostic = [&](string_view line, Diagnostic::Kind kind, string_view message) {
+	diagnostics.Add(MakeRecord(line, FormatIndex(diagnostics_added++), FormatKind(kind), message));
+  };
+  auto add_failure = [&by_bus](string_view bus_name, string_view line,
+		  Diagnostic::Kind kind, const string& message) {
+	by_bus.Add(MakeRecord(bus_name, line, "3", FormatKind(kind), message));
+  };
+
+  //--------Streaming the modify batch--------------------//
+
+  size_t request_count;
+  in_stream >> request_count;
+  string dummy;
+  getline(in_stream, dummy);
+  ++line_number;
+
+  for (size_t i = 0; i < request_count; ++i) {
+	string request_str;
+	getline(in_stream, request_str);
+	++line_number;
+	RequestHolder request = ParseRequest(request_str, true);
+	if (!request) {
+	  continue;
+	}
+	request->line_number = line_number;
+	const string line = FormatIndex(line_number);
+	if (request->parse_error) {
+	  add_diagnostic(line, Diagnostic::Kind::PARSE_ERROR, *request->parse_error);
+	} else if (request->type == Request::Type::MODIFY_STOP) {
+	  const auto& stop = static_cast<const ModifyStopRequest&>(*request);
+	  vector<Diagnostic> range_failures;
+	  const bool ok = CheckStopRanges(stop, range_failures);
+	  for (const Diagnostic& diagnostic: range_failures) {
+		add_diagnostic(line, diagnostic.kind, diagnostic.message);
+	  }
+	  stop_defs.Add(MakeRecord(stop.stop_name, line, "0",
+		  FormatDouble(stop.latitude), FormatDouble(stop.longitude)));
+	  stop_targets.Add(MakeRecord(stop.stop_name, "0", line, ok ? "1" : "0"));
+	  for (const DistanceToStop& dist: stop.distances) {
+		stop_defs.Add(MakeRecord(stop.stop_name, line, "1", dist.stop_name,
+			FormatDouble(dist.distance)));
+		stop_targets.Add(MakeRecord(dist.stop_name, "1", stop.stop_name, line));
+	  }
+	} else if (request->type == Request::Type::MODIFY_BUS) {
+	  const auto& bus = static_cast<const ModifyBusRequest&>(*request);
+	  if (bus.stops.empty()) {
+		add_diagnostic(line, Diagnostic::Kind::EMPTY_ROUTE,
+			"bus " + Quote(bus.bus_name) + " has no stops");
+		continue;
+	  }
+	  const string kind = bus.cycle ? "C" : "N";
+	  const int stop_count = bus.cycle ? CycleRoute::ComputeStopsOnRoute(bus.stops.size())
+			  : NotCycleRoute::ComputeStopsOnRoute(bus.stops.size());
+	  by_bus.Add(MakeRecord(bus.bus_name, line, "0", kind, to_string(stop_count)));
+	  for (const string& stop_name: bus.stops) {
+		bus_stops.Add(MakeRecord(bus.bus_name, line, stop_name));
+	  }
+	  for (size_t j = 0; j + 1 < bus.stops.size(); ++j) {
+		by_from.Add(MakeRecord(bus.stops[j], "1", bus.stops[j + 1], bus.bus_name,
+			FormatIndex(j), kind, line));
+	  }
+	  if (bus.stops.size() == 1) {
+		by_from.Add(MakeRecord(bus.stops[0], "2", bus.bus_name, line));
+	  }
+	}
+  }
+
+  //--------Rejecting stops naming rejected stops--------------------//
+
+  // As in ValidateModifyRequests, a stop definition is rejected when its
+  // ranges fail or one of its road distances names a stop without an
+  // accepted definition. Every round joins the stop targets with the
+  // rejected definitions so far, until no definition is added.
+  const filesystem::path targets_path = work_dir / "stop_targets.sorted";
+  {
+	ofstream targets_out(targets_path);
+	stop_targets.Merge([&targets_out](string_view record) {
+	  targets_out << record << '\n';
+	});
+  }
+  filesystem::path rejected_path = work_dir / "rejected.0";
+  ofstream(rejected_path).close();
+  for (size_t round = 0;; ++round) {
+	ExternalSorter candidates(work_dir, "candidates", sorter_memory);
+	SortedFileReader rejected(rejected_path);
+	ifstream targets_in(targets_path);
+	string current_stop;
+	bool started = false, has_definition = false, all_rejected = true;
+	for (string row; getline(targets_in, row);) {
+	  string_view record = row;
+	  const string_view stop_name = ReadToken(record, "\t");
+	  const string_view tag = ReadToken(record, "\t");
+	  if (!started || stop_name != current_stop) {
+		started = true;
+		current_stop = stop_name;
+		has_definition = false;
+		all_rejected = true;
+	  }
+	  if (tag == "0") {
+		const string_view line = ReadToken(record, "\t");
+		const bool ok = record == "1";
+		if (!ok && round == 0) {
+		  candidates.Add(MakeRecord(stop_name, line));
+		}
+		has_definition = true;
+		all_rejected = all_rejected && (!ok || rejected.SkipTo(MakeRecord(stop_name, line)));
+		continue;
+	  }
+	  const string_view referrer = ReadToken(record, "\t");
+	  if (!has_definition) {
+		if (round == 0) {
+		  add_diagnostic(record, Diagnostic::Kind::UNKNOWN_STOP,
+			  "stop " + Quote(stop_name) + " is not defined");
+		  candidates.Add(MakeRecord(referrer, record));
+		}
+	  } else if (all_rejected) {
+		candidates.Add(MakeRecord(referrer, record, stop_name));
+	  }
+	}
+
+	// the first candidate of a definition carries its reason: none for
+	// the ones reported above, otherwise the first rejected stop it names
+	const filesystem::path next_path = work_dir / ("rejected." + to_string(round + 1));
+	SortedFileReader old_rejected(rejected_path);
+	ofstream rejected_out(next_path);
+	string last_key;
+	size_t added = 0;
+	candidates.Merge([&](string_view record) {
+	  const string_view stop_name = ReadToken(record, "\t");
+	  const string_view line = ReadToken(record, "\t");
+	  string key = MakeRecord(stop_name, line);
+	  if (key == last_key) {
+		return;
+	  }
+	  for (; old_rejected.HasRecord() && old_rejected.Record() < key; old_rejected.Advance()) {
+		rejected_out << old_rejected.Record() << '\n';
+	  }
+	  if (!old_rejected.HasRecord() || old_rejected.Record() != key) {
+		rejected_out << key << '\n';
+		++added;
+		if (!record.empty()) {
+		  add_diagnostic(line, Diagnostic::Kind::UNKNOWN_STOP,
+			  "stop " + Quote(record) + " is rejected");
+		}
+	  }
+	  last_key = move(key);
+	});
+	for (; old_rejected.HasRecord(); old_rejected.Advance()) {
+	  rejected_out << old_rejected.Record() << '\n';
+	}
+	rejected_out.close();
+	filesystem::remove(rejected_path);
+	rejected_path = next_path;
+	if (added == 0) {
+	  break;
+	}
+  }
+  filesystem::remove(targets_path);
+
+  //--------Emitting accepted stops--------------------//
+
+  // A stop keeps the coordinates of its last accepted definition. Of the
+  // distances from a to b the last explicit one wins, or else the first
+  // one given by b, as RouteManager::SetStopData leaves them.
+  {
+	SortedFileReader rejected(rejected_path);
+	string current_stop, latitude, longitude;
+	bool started = false, has_accepted = false, accepted = false;
+	auto flush_stop = [&] {
+	  if (has_accepted) {
+		by_from.Add(MakeRecord(current_stop, "0", latitude, longitude));
+		by_to.Add(MakeRecord(current_stop, "0", latitude, longitude));
+		stop_buses.Add(MakeRecord(current_stop, "0"));
+	  }
+	};
+	stop_defs.Merge([&](string_view record) {
+	  const string_view stop_name = ReadToken(record, "\t");
+	  const string_view line = ReadToken(record, "\t");
+	  const string_view tag = ReadToken(record, "\t");
+	  if (!started || stop_name != current_stop) {
+		flush_stop();
+		started = true;
+		current_stop = stop_name;
+		has_accepted = false;
+	  }
+	  if (tag == "0") {
+		accepted = !rejected.SkipTo(MakeRecord(stop_name, line));
+		if (accepted) {
+		  has_accepted = true;
+		  latitude = ReadToken(record, "\t");
+		  longitude = record;
+		}
+		return;
+	  }
+	  if (!accepted) {
+		return;
+	  }
+	  const string_view to = ReadToken(record, "\t");
+	  const string explicit_order = FormatIndex(MAX_FORMATTED_INDEX - ConvertToUnsigned(line));
+	  by_pair.Add(MakeRecord(stop_name, to, "0", "0", explicit_order, record));
+	  by_pair.Add(MakeRecord(to, stop_name, "0", "1", line, record));
+	});
+	flush_stop();
+  }
+  filesystem::remove(rejected_path);
+
+  //--------Joining segments with the first stop--------------------//
+
+  CurrentStop current;
+  by_from.Merge([&](string_view record) {
+	const string_view stop_name = ReadToken(record, "\t");
+	const string_view tag = ReadToken(record, "\t");
+	if (tag == "0") {
+	  const string_view latitude = ReadToken(record, "\t");
+	  current.Set(stop_name, latitude, record);
+	  return;
+	}
+	if (tag == "2") {
+	  const string_view bus_name = ReadToken(record, "\t");
+	  if (!current.Matches(stop_name)) {
+		add_failure(bus_name, record, Diagnostic::Kind::UNKNOWN_STOP,
+			"stop " + Quote(stop_name) + " is not defined");
+	  }
+	  return;
+	}
+	const string_view to = ReadToken(record, "\t");
+	const string_view bus_name = ReadToken(record, "\t");
+	if (current.Matches(stop_name)) {
+	  by_to.Add(MakeRecord(to, "1", stop_name, bus_name, record,
+		  current.latitude, current.longitude));
+	  return;
+	}
+	// the segment still goes on, so that its second stop is checked too
+	by_to.Add(MakeRecord(to, "1", stop_name, bus_name, record));
+	ReadToken(record, "\t");
+	ReadToken(record, "\t");
+	add_failure(bus_name, record, Diagnostic::Kind::UNKNOWN_STOP,
+		"stop " + Quote(stop_name) + " is not defined");
+  });
+
+  //--------Joining segments with the second stop--------------------//
+
+  current = {};
+  by_to.Merge([&](string_view record) {
+	const string_view stop_name = ReadToken(record, "\t");
+	const string_view tag = ReadToken(record, "\t");
+	if (tag == "0") {
+	  const string_view latitude = ReadToken(record, "\t");
+	  current.Set(stop_name, latitude, record);
+	  return;
+	}
+	const string_view from = ReadToken(record, "\t");
+	const string_view bus_name = ReadToken(record, "\t");
+	const string_view index = ReadToken(record, "\t");
+	const string_view kind = ReadToken(record, "\t");
+	const string_view line = ReadToken(record, "\t");
+	if (!current.Matches(stop_name)) {
+	  add_failure(bus_name, line, Diagnostic::Kind::UNKNOWN_STOP,
+		  "stop " + Quote(stop_name) + " is not defined");
+	  return;
+	}
+	if (record.empty()) {
+	  return;
+	}
+	const string_view from_latitude = ReadToken(record, "\t");
+	const double distance = ComputeDistance(
+		Coords{ConvertToDouble(from_latitude), ConvertToDouble(record)},
+		Coords{ConvertToDouble(current.latitude), ConvertToDouble(current.longitude)});
+	by_pair.Add(MakeRecord(from, stop_name, "1", bus_name, index, "0", line,
+		FormatDouble(distance)));
+	if (kind == "N") {
+	  by_pair.Add(MakeRecord(stop_name, from, "1", bus_name, index, "1", line));
+	}
+  });
+
+  //--------Joining segments with road distances--------------------//
+
+  string current_pair;
+  optional<string> current_distance;
+  by_pair.Merge([&](string_view record) {
+	const string_view from = ReadToken(record, "\t");
+	const string_view to = ReadToken(record, "\t");
+	const string_view tag = ReadToken(record, "\t");
+	const string pair = MakeRecord(from, to);
+	if (pair != current_pair) {
+	  current_pair = pair;
+	  current_distance = nullopt;
+	}
+	if (tag == "0") {
+	  ReadToken(record, "\t");
+	  ReadToken(record, "\t");
+	  if (!current_distance) {
+		current_distance = string(record);
+	  }
+	  return;
+	}
+	const string_view bus_name = ReadToken(record, "\t");
+	const string_view index = ReadToken(record, "\t");
+	const string_view direction = ReadToken(record, "\t");
+	const string_view line = ReadToken(record, "\t");
+	if (!current_distance) {
+	  if (direction == "0") {
+		add_failure(bus_name, line, Diagnostic::Kind::MISSING_DISTANCE,
+			"no road distance between " + Quote(from) + " and " + Quote(to));
+	  }
+	} else if (direction == "0") {
+	  by_bus.Add(MakeRecord(bus_name, line, "2", index, "0", record, *current_distance));
+	} else {
+	  by_bus.Add(MakeRecord(bus_name, line, "2", index, "1", *current_distance));
+	}
+  });
+
+  //--------Counting unique stops--------------------//
+
+  string current_definition, last_stop;
+  int unique_stop_count = 0;
+  auto flush_unique = [&] {
+	if (!current_definition.empty()) {
+	  by_bus.Add(MakeRecord(current_definition, "1", to_string(unique_stop_count)));
+	}
+  };
+  bus_stops.Merge([&](string_view record) {
+	const string_view bus_name = ReadToken(record, "\t");
+	const string_view line = ReadToken(record, "\t");
+	string definition = MakeRecord(bus_name, line);
+	if (definition != current_definition) {
+	  flush_unique();
+	  current_definition = move(definition);
+	  last_stop.clear();
+	  unique_stop_count = 0;
+	}
+	if (unique_stop_count == 0 || record != last_stop) {
+	  last_stop = record;
+	  ++unique_stop_count;
+	  definition_stops.Add(MakeRecord(current_definition, "1", record));
+	}
+  });
+  flush_unique();
+
+  //--------Aggregating bus statistics--------------------//
+
+  // Sums are accumulated segment by segment in route order exactly as
+  // RouteManager::SetBusData does, so both builds print the same stats.
+  // The definitions of a bus come in line order, and the last one without
+  // failures is kept, as the in-memory build leaves it.
+  bus_table = make_unique<DiskTable>(work_dir / "buses.table");
+  struct BusAggregate {
+	string line;
+	bool cycle = false;
+	string stop_count, unique_stop_count;
+	double route_distance = 0;
+	uint64_t real_route_distance = 0;
+	double forward_distance = 0;
+	bool failed = false;
+  };
+  string bus_name;
+  BusAggregate bus;
+  optional<BusAggregate> accepted_bus;
+  auto flush_definition = [&] {
+	if (bus.line.empty()) {
+	  return;
+	}
+	if (bus.failed) {
+	  definition_stops.Add(MakeRecord(bus_name, bus.line, "0"));
+	} else {
+	  accepted_bus = move(bus);
+	}
+  };
+  auto flush_bus = [&] {
+	flush_definition();
+	if (!accepted_bus) {
+	  return;
+	}
+	const double curvature = accepted_bus->real_route_distance / accepted_bus->route_distance;
+	bus_table->Append(bus_name, MakeRecord(accepted_bus->stop_count,
+		accepted_bus->unique_stop_count, to_string(accepted_bus->real_route_distance),
+		FormatDouble(curvature)));
+  };
+  by_bus.Merge([&](string_view record) {
+	const string_view name = ReadToken(record, "\t");
+	const string_view line = ReadToken(record, "\t");
+	const string_view tag = ReadToken(record, "\t");
+	if (name != bus_name) {
+	  flush_bus();
+	  bus_name = name;
+	  accepted_bus = nullopt;
+	  bus = {};
+	  bus.line = line;
+	} else if (line != bus.line) {
+	  flush_definition();
+	  bus = {};
+	  bus.line = line;
+	}
+	if (tag == "0") {
+	  bus.cycle = ReadToken(record, "\t") == "C";
+	  bus.stop_count = record;
+	} else if (tag == "1") {
+	  bus.unique_stop_count = record;
+	} else if (tag == "2") {
+	  ReadToken(record, "\t");
+	  if (ReadToken(record, "\t") == "0") {
+		const double distance = ConvertToDouble(ReadToken(record, "\t"));
+		const double road_distance = ConvertToDouble(record);
+		if (bus.cycle) {
+		  bus.route_distance += CycleRoute::GEO_FACTOR * distance;
+		  bus.real_route_distance += road_distance;
+		} else {
+		  bus.route_distance += NotCycleRoute::GEO_FACTOR * distance;
+		  bus.forward_distance = road_distance;
+		}
+	  } else {
+		bus.real_route_distance += bus.forward_distance + ConvertToDouble(record);
+	  }
+	} else {
+	  bus.failed = true;
+	  const auto kind = static_cast<Diagnostic::Kind>(ConvertToUnsigned(ReadToken(record, "\t")));
+	  add_diagnostic(line, kind, record);
+	}
+  });
+  flush_bus();
+  bus_table->Finish();
+
+  //--------Collecting buses of every stop--------------------//
+
+  // every accepted definition of a bus adds it to its stops
+  string rejected_definition;
+  definition_stops.Merge([&](string_view record) {
+	const string_view name = ReadToken(record, "\t");
+	const string_view line = ReadToken(record, "\t");
+	const string_view tag = ReadToken(record, "\t");
+	if (tag == "0") {
+	  rejected_definition = MakeRecord(name, line);
+	} else if (rejected_definition != MakeRecord(name, line)) {
+	  stop_buses.Add(MakeRecord(record, "1", name));
+	}
+  });
+
+  stop_table = make_unique<DiskTable>(work_dir / "stops.table");
+  string current_stop, buses, last_bus;
+  bool started = false, stop_defined = false;
+  auto flush_stop = [&] {
+	if (stop_defined) {
+	  stop_table->Append(current_stop, buses);
+	}
+  };
+  stop_buses.Merge([&](string_view record) {
+	const string_view stop_name = ReadToken(record, "\t");
+	const string_view tag = ReadToken(record, "\t");
+	if (!started || stop_name != current_stop) {
+	  flush_stop();
+	  started = true;
+	  current_stop = stop_name;
+	  stop_defined = false;
+	  buses.clear();
+	  last_bus.clear();
+	}
+	if (tag == "0") {
+	  stop_defined = true;
+	} else if (record != last_bus) {
+	  last_bus = record;
+	  buses += buses.empty() ? "" : "\t";
+	  buses += record;
+	}
+  });
+  flush_stop();
+  stop_table->Finish();
+
+  //--------Writing diagnostics--------------------//
+
+  diagnostics_path = work_dir / "diagnostics";
+  ofstream diagnostics_out(diagnostics_path);
+  string current_line;
+  set<string> line_messages;
+  diagnostics.Merge([&](string_view record) {
+	const string_view line = ReadToken(record, "\t");
+	ReadToken(record, "\t");
+	const string_view kind = ReadToken(record, "\t");
+	if (line != current_line) {
+	  current_line = line;
+	  line_messages.clear();
+	}
+	// identical diagnostics of a line are given once, as in
+	// ValidateModifyRequests; both stops of a segment may report the same
+	// undefined stop
+	if (line_messages.insert(string(record)).second) {
+	  diagnostics_out << MakeRecord(line, kind, record) << '\n';
+	  ++diagnostics_count;
+	}
+  });
+}
+
+ExternalRouteDataBase::~ExternalRouteDataBase() {
+  bus_table.reset();
+  stop_table.reset();
+  error_code ec;
+  filesystem::remove_all(work_dir, ec);
+}
+
+void ExternalRouteDataBase::PrintDiagnostics(ostream& stream) const {
+  ifstream input(diagnostics_path);
+  for (string row; getline(input, row);) {
+	string_view fields = row;
+	const size_t line = ConvertToUnsigned(ReadToken(fields, "\t"));
+	const auto kind = static_cast<Diagnostic::Kind>(ConvertToUnsigned(ReadToken(fields, "\t")));
+	::PrintDiagnostics({{line, kind, string(fields)}}, stream);
+  }
+}
+
+optional<BusStats> ExternalRouteDataBase::GetBusStats(string_view bus_name) const {
+  const auto row = bus_table->Find(bus_name);
+  if (!row) {
+	return nullopt;
+  }
+  string_view fields = *row;
+  BusStats stats;
+  stats.stop_count = ConvertToDouble(ReadToken(fields, "\t"));
+  stats.unique_stop_count = ConvertToDouble(ReadToken(fields, "\t"));
+  stats.route_distance = ConvertToDouble(ReadToken(fields, "\t"));
+  stats.curvature = ConvertToDouble(fields);
+  return stats;
+}
+
+optional<set<string>> ExternalRouteDataBase::GetStopStats(string_view stop_name) const {
+  const auto row = stop_table->Find(stop_name);
+  if (!row) {
+	return nullopt;
+  }
+  set<string> buses;
+  string_view fields = *row;
+  while (!fields.empty()) {
+	buses.insert(string(ReadToken(fields, "\t")));
+  }
+  return buses;
+}
+
+//---------------------ExternalRouteDataBase----------------------//
+
+void TestExternalSorter() {
+  const filesystem::path dir = filesystem::temp_directory_path();
+  ExternalSorter sorter(dir, "test_sorter." + to_string(random_device()()), 1);
+  vector<string> expected;
+  for (int i = 0; i < 200; ++i) {
+	string record = MakeRecord(to_string(i * 7919 % 200), "x");
+	sorter.Add(record);
+	expected.push_back(record);
+  }
+  sort(begin(expected), end(expected));
+  vector<string> merged;
+  sorter.Merge([&merged](string_view record) {
+	merged.push_back(string(record));
+  });
+  ASSERT_EQUAL(merged, expected);
+}
+
+void TestExternalRouteDataBase() {
+  const string modify_batch = "11\n"
+	"Stop Tolstopaltsevo: 55.611087, 37.20829, 3900m to Marushkino\n"
+	"Stop Marushkino: 55.595884, 37.209755, 9900m to Rasskazovka\n"
+	"Bus 256: Biryulyovo Zapadnoye > Biryusinka > Universam > "
+	  "Biryulyovo Tovarnaya > Biryulyovo Passazhirskaya > Biryulyovo Zapadnoye\n"
+	"Bus 750: Tolstopaltsevo - Marushkino - Rasskazovka\n"
+	"Stop Rasskazovka: 55.632761, 37.333324\n"
+	"Stop Biryulyovo Zapadnoye: 55.574371, 37.6517, 1800m to Biryusinka, "
+	  "2400m to Universam\n"
+	"Stop Biryusinka: 55.581065, 37.64839, 750m to Universam\n"
+	"Stop Universam: 55.587655, 37.645687, 900m to Biryulyovo Tovarnaya\n"
+	"Stop Biryulyovo Tovarnaya: 55.592028, 37.653656, 1300m to Biryulyovo Passazhirskaya\n"
+	"Stop Biryulyovo Passazhirskaya: 55.580999, 37.659164, 1200m to Biryulyovo Zapadnoye\n"
+	"Bus 828: Biryulyovo Zapadnoye > Universam > Rossoshanskaya ulitsa > Biryulyovo Zapadnoye\n";
+
+  ExternalBuildOptions options;
+  options.memory_limit = 600;
+  stringstream ss(modify_batch);
+  size_t line_number = 0;
+  const ExternalRouteDataBase db(ss, options, line_number);
+  ASSERT_EQUAL(line_number, 12u);
+
+  // Rossoshanskaya ulitsa is missing from the batch, so bus 828 is rejected
+  ASSERT_EQUAL(db.GetDiagnosticsCount(), 1u);
+  {
+	ostringstream os;
+	db.PrintDiagnostics(os);
+	ASSERT_EQUAL(os.str(),
+	  "line 12: unknown stop: stop \"Rossoshanskaya ulitsa\" is not defined\n");
+  }
+
+  {
+	ostringstream os;
+	os.precision(6);
+	PrintRouteResponse("256", db.GetBusStats("256"), os);
+	PrintRouteResponse("750", db.GetBusStats("750"), os);
+	PrintRouteResponse("828", db.GetBusStats("828"), os);
+	ASSERT_EQUAL(os.str(),
+	  "Bus 256: 6 stops on route, 5 unique stops, 5950 route length, 1.36124 curvature\n"
+	  "Bus 750: 5 stops on route, 3 unique stops, 27600 route length, 1.31808 curvature\n"
+	  "Bus 828: not found\n");
+  }
+  ASSERT_EQUAL(*db.GetStopStats("Biryulyovo Zapadnoye"), set<string>({"256"}));
+  ASSERT_EQUAL(*db.GetStopStats("Marushkino"), set<string>({"750"}));
+  ASSERT(!db.GetStopStats("Rossoshanskaya ulitsa"));
+  ASSERT(!db.GetStopStats("Samara"));
+}
+
+void TestExternalRepeatedDefinitions() {
+  stringstream ss("11\n"
+	"Stop A: 55.6, 37.2, 300m to B\n"
+	"Stop B: 55.601, 37.2, 300m to C\n"
+	"Stop C: 55.602, 37.2\n"
+	"Bus 1: A - B\n"
+	"Bus 1: B - C\n"
+	"Stop D: 55.6, 37.2, 100m to Nowhere\n"
+	"Stop E: 55.6, 37.2, 100m to D\n"
+	"Bus 2: A - E\n"
+	"Bus 1: A - D\n"
+	"Stop C: 55.603, 37.2, 500m to B\n"
+	"Stop A: 95.6, 37.2\n"
+  );
+  ExternalBuildOptions options;
+  options.memory_limit = 300;
+  size_t line_number = 0;
+  const ExternalRouteDataBase db(ss, options, line_number);
+
+  // the same diagnostics and tables as ValidateModifyRequests in skip mode
+  // and RouteManager leave
+  ostringstream os;
+  db.PrintDiagnostics(os);
+  ASSERT_EQUAL(os.str(),
+	"line 7: unknown stop: stop \"Nowhere\" is not defined\n"
+	"line 8: unknown stop: stop \"D\" is rejected\n"
+	"line 9: unknown stop: stop \"E\" is not defined\n"
+	"line 10: unknown stop: stop \"D\" is not defined\n"
+	"line 12: coordinates out of range: coordinates 95.6, 37.2 of stop \"A\" are out of range\n");
+  os.str("");
+  os.precision(6);
+  PrintRouteResponse("1", db.GetBusStats("1"), os);
+  PrintRouteResponse("2", db.GetBusStats("2"), os);
+  ASSERT_EQUAL(os.str(),
+	"Bus 1: 3 stops on route, 2 unique stops, 800 route length, 1.79864 curvature\n"
+	"Bus 2: not found\n");
+  ASSERT_EQUAL(*db.GetStopStats("A"), set<string>({"1"}));
+  ASSERT_EQUAL(*db.GetStopStats("C"), set<string>({"1"}));
+  ASSERT(!db.GetStopStats("D"));
+  ASSERT(!db.GetStopStats("E"));
+
+  // a bus naming the same undefined stop, or the same pair of stops
+  // without a distance, more than once
+  const string repeated_stops = "4\n"
+	"Stop S: 55.6, 37.2\n"
+	"Bus 1: Q - Q\n"
+	"Bus 5: S4 > S4 > S4\n"
+	"Bus 6: S > S > S\n";
+  stringstream in_memory_input(repeated_stops);
+  ostringstream in_memory;
+  PrintValidationReport(ValidateModifyRequests(ReadRequests(in_memory_input, true), 1),
+	  in_memory);
+  stringstream external_input(repeated_stops);
+  line_number = 0;
+  ostringstream external;
+  ExternalRouteDataBase(external_input, options, line_number).PrintDiagnostics(external);
+  ASSERT_EQUAL(external.str(), in_memory.str());
+  ASSERT_EQUAL(in_memory.str(),
+	"line 3: unknown stop: stop \"Q\" is not defined\n"
+	"line 4: unknown stop: stop \"S4\" is not defined\n"
+	"line 5: missing distance: no road distance between \"S\" and \"S\"\n");
+}
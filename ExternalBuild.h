@@ -0,0 +1,109 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "RouteManager.h"
+#include "Validation.h"
+
+//---------------------External Memory Build----------------------//
+
+struct ExternalBuildOptions {
+  size_t memory_limit = 256 << 20;
+  std::filesystem::path temp_dir = std::filesystem::temp_directory_path();
+};
+
+// Sorts more text records than fit in memory. Records are single lines of
+// tab-separated fields, so plain byte order sorts them field by field.
+// Records are buffered up to memory_limit bytes, then sorted and spilled
+// to a run file; Merge streams all runs back in one sorted sequence.
+class ExternalSorter {
+public:
+  ExternalSorter(std::filesystem::path dir, std::string name, size_t memory_limit);
+  ExternalSorter(const ExternalSorter&) = delete;
+  ExternalSorter& operator=(const ExternalSorter&) = delete;
+  ~ExternalSorter();
+
+  void Add(std::string record);
+  void Merge(const std::function<void(std::string_view)>& callback);
+
+private:
+  void Spill();
+  std::filesystem::path MergeRuns(size_t first, size_t last);
+  void MergeRuns(size_t first, size_t last,
+		  const std::function<void(std::string_view)>& callback);
+
+  std::filesystem::path dir;
+  std::string name;
+  size_t memory_limit;
+  size_t memory_used = 0;
+  std::vector<std::string> buffer;
+  std::vector<std::filesystem::path> runs;
+};
+
+// Rows "key\tvalue" appended in key order to a file; lookups binary search
+// a sparse in-memory index of every SPARSE_STEP-th key and scan from there.
+class DiskTable {
+public:
+  explicit DiskTable(std::filesystem::path path);
+
+  void Append(std::string_view key, std::string_view value);
+  void Finish();
+  std::optional<std::string> Find(std::string_view key) const;
+
+private:
+  static const size_t SPARSE_STEP = 64;
+
+  std::filesystem::path path;
+  std::ofstream writer;
+  mutable std::ifstream reader;
+  size_t rows_count = 0;
+  std::streamoff offset = 0;
+  std::vector<std::pair<std::string, std::streamoff>> sparse_index;
+};
+
+// Builds bus and stop tables from a modify batch streamed from in_stream
+// without holding the batch or the network in memory. Stops, distances and
+// route segments are spilled to sorted runs and joined by merge passes.
+// Invalid entries are left out of the tables and reported in diagnostics,
+// which are kept on disk too. Validation matches ValidateModifyRequests,
+// and a repeated bus keeps its last accepted definition.
+class ExternalRouteDataBase {
+public:
+  ExternalRouteDataBase(std::istream& in_stream, const ExternalBuildOptions& options,
+		  size_t& line_number);
+  ~ExternalRouteDataBase();
+
+  std::optional<BusStats> GetBusStats(std::string_view bus_name) const;
+  std::optional<std::set<std::string>> GetStopStats(std::string_view stop_name) const;
+
+  size_t GetDiagnosticsCount() const {
+	return diagnostics_count;
+  }
+
+  // In the format of PrintDiagnostics, sorted by line number.
+  void PrintDiagnostics(std::ostream& stream) const;
+
+private:
+  std::filesystem::path work_dir;
+  std::filesystem::path diagnostics_path;
+  size_t diagnostics_count = 0;
+  std::unique_ptr<DiskTable> bus_table;
+  std::unique_ptr<DiskTable> stop_table;
+};
+
+//---------------------External Memory Build----------------------//
+
+//---------------------Tests-----------------------------------//
+void TestExternalSorter();
+void TestExternalRouteDataBase();
+void TestExternalRepeatedDefinitions();
+//---------------------Tests-----------------------------------//
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+//---------------------Flat Index------------------------------//
+
+// Bit array answering "definitely absent" for names that were never added,
+// so most lookups of unknown names stop before the hash table.
+class BloomFilter {
+public:
+  void Reset(size_t keys_count) {
+	size_t bits_count = 64;
+	while (bits_count < keys_count * BITS_PER_KEY) {
+	  bits_count *= 2;
+	}
+	bits.assign(bits_count / 64, 0);
+	mask = bits_count - 1;
+  }
+
+  void Add(uint64_t hash) {
+	uint64_t h = hash;
+	for (size_t i = 0; i < HASHES_COUNT; ++i, h += Step(hash)) {
+	  bits[(h & mask) / 64] |= uint64_t(1) << (h % 64);
+	}
+  }
+
+  bool MayContain(uint64_t hash) const {
+	uint64_t h = hash;
+	for (size_t i = 0; i < HASHES_COUNT; ++i, h += Step(hash)) {
+	  if (!(bits[(h & mask) / 64] & (uint64_t(1) << (h % 64)))) {
+		return false;
+	  }
+	}
+	return true;
+  }
+
+private:
+  static const size_t BITS_PER_KEY = 10;
+  static const size_t HASHES_COUNT = 7;
+
+  static uint64_t Step(uint64_t hash) {
+	return (hash >> 32) | 1;
+  }
+
+  std::vector<uint64_t> bits;
+  uint64_t mask = 0;
+};
+
+// Read-only open addressing table from names to values, built once after
+// ingest. Slots keep the full hash next to the name, so a probe compares
+// strings only on a hash match; lookups take string_view and never
+// allocate. Keys are views, so the storage they point to must outlive it.
+template <typename Value>
+class FlatNameIndex {
+public:
+  void Build(const std::vector<std::pair<std::string_view, Value>>& entries) {
+	size_t capacity = 16;
+	while (capacity < entries.size() * 2) {
+	  capacity *= 2;
+	}
+	slots.assign(capacity, Slot{});
+	mask = capacity - 1;
+	filter.Reset(entries.size());
+	for (const auto& [name, value]: entries) {
+	  const uint64_t hash = Hash(name);
+	  filter.Add(hash);
+	  size_t i = hash & mask;
+	  while (slots[i].hash != EMPTY) {
+		i = (i + 1) & mask;
+	  }
+	  slots[i] = Slot{hash, name, value};
+	}
+  }
+
+  // Finds nothing in an index that was never built.
+  const Value* Find(std::string_view name) const {
+	if (slots.empty()) {
+	  return nullptr;
+	}
+	const uint64_t hash = Hash(name);
+	if (!filter.MayContain(hash)) {
+	  return nullptr;
+	}
+	for (size_t i = hash & mask; slots[i].hash != EMPTY; i = (i + 1) & mask) {
+	  if (slots[i].hash == hash && slots[i].name == name) {
+		return &slots[i].value;
+	  }
+	}
+	return nullptr;
+  }
+
+private:
+  static const uint64_t EMPTY = 0;
+
+  struct Slot {
+	uint64_t hash = EMPTY;
+	std::string_view name;
+	Value value{};
+  };
+
+  static uint64_t Hash(std::string_view name) {
+	const uint64_t hash = std::hash<std::string_view>()(name);
+	return hash == EMPTY ? 1 : hash;
+  }
+
+  std::vector<Slot> slots;
+  uint64_t mask = 0;
+  BloomFilter filter;
+};
+
+//---------------------Flat Index------------------------------//
+
+//---------------------Tests-----------------------------------//
+void TestFlatNameIndex();
+//---------------------Tests-----------------------------------//
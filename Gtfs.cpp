@@ -0,0 +1,937 @@
+#include "Gtfs.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include "Requests.h"
+#include "test_runner.h"
+
+using namespace std;
+
+//------------------CSV Scanner---------------------------//
+
+CsvScanner::CsvScanner(istream& input, size_t chunk_size, bool has_header)
+  : input(input), buffer(max<size_t>(chunk_size, 4)) {
+  if (!has_header) {
+	return;
+  }
+  input.read(buffer.data(), 3);
+  data_end = input.gcount();
+  if (data_end == 3 && memcmp(buffer.data(), "\xEF\xBB\xBF", 3) == 0) {
+	data_end = 0;
+	buffer_offset = 3;
+  }
+  if (Next()) {
+	for (string_view name: fields) {
+	  while (!name.empty() && name.front() == ' ') {
+		name.remove_prefix(1);
+	  }
+	  while (!name.empty() && name.back() == ' ') {
+		name.remove_suffix(1);
+	  }
+	  header.emplace_back(name);
+	}
+  }
+  fields.clear();
+}
+
+bool CsvScanner::Next() {
+  size_t record_end;
+  do {
+	if (!FindRecordEnd(record_end)) {
+	  fields.clear();
+	  return false;
+	}
+	record_offset = GetOffset();
+	SplitRecord(record_end);
+  } while (fields.size() == 1 && fields[0].empty());
+  return true;
+}
+
+optional<size_t> CsvScanner::FindColumn(string_view name) const {
+  const auto it = find(begin(header), end(header), name);
+  return it != end(header) ? optional<size_t>(it - begin(header)) : nullopt;
+}
+
+bool CsvScanner::FindRecordEnd(size_t& record_end) {
+  size_t scan = data_begin;
+  bool quoted = false;
+  while (true) {
+	while (scan < data_end) {
+	  const char* start = buffer.data() + scan;
+	  if (quoted) {
+		const char* quote = static_cast<const char*>(memchr(start, '"', data_end - scan));
+		if (!quote) {
+		  scan = data_end;
+		  break;
+		}
+		quoted = false;
+		scan = quote - buffer.data() + 1;
+		continue;
+	  }
+	  const char* newline = static_cast<const char*>(memchr(start, '\n', data_end - scan));
+	  const size_t limit = newline ? newline - buffer.data() : data_end;
+	  const char* quote = static_cast<const char*>(memchr(start, '"', limit - scan));
+	  if (quote) {
+		quoted = true;
+		scan = quote - buffer.data() + 1;
+	  } else if (newline) {
+		record_end = limit;
+		return true;
+	  } else {
+		scan = data_end;
+	  }
+	}
+	if (input_done) {
+	  record_end = data_end;
+	  return data_begin != data_end;
+	}
+	// keep the unfinished record and read the next chunk after it
+	memmove(buffer.data(), buffer.data() + data_begin, data_end - data_begin);
+	buffer_offset += data_begin;
+	scan -= data_begin;
+	data_end -= data_begin;
+	data_begin = 0;
+	if (data_end == buffer.size()) {
+	  buffer.resize(buffer.size() * 2);
+	}
+	input.read(buffer.data() + data_end, buffer.size() - data_end);
+	const size_t read_count = input.gcount();
+	data_end += read_count;
+	input_done = read_count == 0;
+  }
+}
+
+void CsvScanner::SplitRecord(size_t record_end) {
+  const size_t next_begin = record_end < data_end ? record_end + 1 : data_end;
+  if (record_end > data_begin && buffer[record_end - 1] == '\r') {
+	--record_end;
+  }
+  char* const data = buffer.data();
+  fields.clear();
+  size_t pos = data_begin;
+  while (true) {
+	size_t field_end;
+	if (pos < record_end && data[pos] == '"') {
+	  size_t out = pos, in = pos + 1;
+	  while (in < record_end) {
+		if (data[in] != '"') {
+		  data[out++] = data[in++];
+		} else if (in + 1 < record_end && data[in + 1] == '"') {
+		  data[out++] = '"';
+		  in += 2;
+		} else {
+		  ++in;
+		  break;
+		}
+	  }
+	  fields.emplace_back(data + pos, out - pos);
+	  field_end = find(data + in, data + record_end, ',') - data;
+	} else {
+	  field_end = find(data + pos, data + record_end, ',') - data;
+	  fields.emplace_back(data + pos, field_end - pos);
+	}
+	if (field_end >= record_end) {
+	  break;
+	}
+	pos = field_end + 1;
+  }
+  data_begin = next_begin;
+}
+
+//------------------CSV Scanner---------------------------//
+
+//------------------Feed Files----------------------------//
+
+namespace {
+
+const uint32_t NONE = numeric_limits<uint32_t>::max();
+// the stop_sequence of a rejected row; it sorts last and drops its trip
+const size_t REJECTED_SEQUENCE = numeric_limits<size_t>::max();
+
+// Dense ids for the string ids of a feed. Rows of one trip or shape come
+// in runs, so the id of the previous name is checked before the table.
+class NameInterner {
+public:
+  uint32_t Intern(string_view name) {
+	if (last_id != NONE && name == names[last_id]) {
+	  return last_id;
+	}
+	auto it = ids.find(name);
+	if (it == ids.end()) {
+	  names.emplace_back(name);
+	  it = ids.emplace(names.back(), names.size() - 1).first;
+	}
+	return last_id = it->second;
+  }
+
+  optional<uint32_t> Find(string_view name) const {
+	const auto it = ids.find(name);
+	return it != ids.end() ? optional<uint32_t>(it->second) : nullopt;
+  }
+
+  const string& GetName(uint32_t id) const {
+	return names[id];
+  }
+
+  size_t Size() const {
+	return names.size();
+  }
+
+  // Ids in this interner of all names of other, indexed by their ids there.
+  vector<uint32_t> InternAll(const NameInterner& other) {
+	vector<uint32_t> result;
+	result.reserve(other.Size());
+	for (const string& name: other.names) {
+	  result.push_back(Intern(name));
+	}
+	return result;
+  }
+
+private:
+  deque<string> names;
+  unordered_map<string_view, uint32_t> ids;
+  uint32_t last_id = NONE;
+};
+
+class FeedFile {
+public:
+  explicit FeedFile(const filesystem::path& path_)
+	: path(path_), stream(path), scanner(stream) {
+	if (!stream.is_open()) {
+	  throw runtime_error("cannot open " + path.string());
+	}
+  }
+
+  // Scans only the records in the byte range of the file of header_file.
+  FeedFile(const FeedFile& header_file_, pair<size_t, size_t> range)
+	: path(header_file_.path), header_file(&header_file_), stream(path),
+	  scanner(SeekTo(stream, range.first), 1 << 20, false),
+	  range_begin(range.first), range_length(range.second - range.first) {
+  }
+
+  // Splits the records into up to parts_count byte ranges for FeedFile
+  // instances scanning in parallel. Ranges start right after a line break,
+  // so records must not have line breaks within quotes, which feeds do
+  // not use for the large files.
+  vector<pair<size_t, size_t>> SplitRecords(size_t parts_count) const {
+	const size_t first = scanner.GetOffset();
+	const size_t size = filesystem::file_size(path);
+	vector<size_t> starts = {first};
+	ifstream probe(path);
+	for (size_t part = 1; part < parts_count; ++part) {
+	  const size_t position = first + (size - first) * part / parts_count;
+	  if (position <= starts.back()) {
+		continue;
+	  }
+	  probe.seekg(position - 1);
+	  probe.ignore(numeric_limits<streamsize>::max(), '\n');
+	  const streamoff start = probe.tellg();
+	  if (start < 0) {
+		break;
+	  }
+	  starts.push_back(start);
+	}
+	vector<pair<size_t, size_t>> ranges;
+	for (size_t i = 0; i < starts.size(); ++i) {
+	  ranges.push_back({starts[i], i + 1 < starts.size() ? starts[i + 1] : size});
+	}
+	return ranges;
+  }
+
+  size_t GetColumn(string_view name) const {
+	const auto column = FindColumn(name);
+	if (!column) {
+	  throw runtime_error(path.filename().string() + ": no column " + string(name));
+	}
+	return *column;
+  }
+
+  optional<size_t> FindColumn(string_view name) const {
+	return (header_file ? header_file->scanner : scanner).FindColumn(name);
+  }
+
+  bool Next() {
+	return scanner.GetOffset() < range_length && scanner.Next();
+  }
+
+  string_view GetField(optional<size_t> column) const {
+	return scanner.GetField(column);
+  }
+
+  // NaN for an empty field.
+  double GetNumber(optional<size_t> column) const {
+	const string_view field = TrimSpaces(GetField(column));
+	if (field.empty()) {
+	  return numeric_limits<double>::quiet_NaN();
+	}
+	double result;
+	const auto [end, error] = from_chars(field.data(), field.data() + field.size(), result);
+	if (error != errc() || end != field.data() + field.size()) {
+	  throw runtime_error(path.filename().string() + " at byte " +
+		  to_string(range_begin + scanner.GetRecordOffset()) + ": " + string(field) +
+		  " is not a number");
+	}
+	return result;
+  }
+
+  // nullopt for a field that is not a plain unsigned integer, as the
+  // sequence columns must be.
+  optional<size_t> GetUnsigned(optional<size_t> column) const {
+	try {
+	  return ConvertToUnsigned(TrimSpaces(GetField(column)));
+	} catch (const exception&) {
+	  return nullopt;
+	}
+  }
+
+private:
+  static string_view TrimSpaces(string_view field) {
+	while (!field.empty() && field.front() == ' ') {
+	  field.remove_prefix(1);
+	}
+	while (!field.empty() && field.back() == ' ') {
+	  field.remove_suffix(1);
+	}
+	return field;
+  }
+
+  static istream& SeekTo(istream& input, size_t position) {
+	input.seekg(position);
+	return input;
+  }
+
+  filesystem::path path;
+  const FeedFile* header_file = nullptr;
+  ifstream stream;
+  CsvScanner scanner;
+  size_t range_begin = 0;
+  size_t range_length = numeric_limits<size_t>::max();
+};
+
+// Reads the parts of file in parallel and merges the results in order.
+template <typename Table, typename ReadPart, typename Merge>
+Table ReadInParts(const FeedFile& file, size_t thread_count, ReadPart read_part, Merge merge) {
+  vector<future<Table>> parts;
+  for (const auto& range: file.SplitRecords(thread_count)) {
+	parts.push_back(async(thread_count > 1 ? launch::async : launch::deferred,
+		[&file, read_part, range] {
+	  FeedFile part(file, range);
+	  return read_part(part);
+	}));
+  }
+  Table table = parts.front().get();
+  for (size_t i = 1; i < parts.size(); ++i) {
+	Table part = parts[i].get();
+	merge(table, part);
+  }
+  return table;
+}
+
+struct StopRecord {
+  string name;
+  Coords coords;
+};
+
+struct StopsTable {
+  NameInterner ids;
+  vector<StopRecord> stops;
+};
+
+struct TripRecord {
+  string route_id;
+  string shape_id;
+};
+
+struct TripsTable {
+  NameInterner ids;
+  vector<TripRecord> trips;
+};
+
+struct StopTimeRecord {
+  uint32_t trip;
+  uint32_t stop;
+  size_t sequence;
+  double shape_dist;
+};
+
+struct StopTimesTable {
+  NameInterner trip_ids;
+  NameInterner stop_ids;
+  vector<StopTimeRecord> rows;
+  size_t rejected_rows_count = 0;
+};
+
+struct ShapePoint {
+  size_t sequence;
+  Coords coords;
+};
+
+struct ShapesTable {
+  NameInterner ids;
+  vector<vector<ShapePoint>> shapes;
+  size_t rejected_rows_count = 0;
+};
+
+long double ToRadians(double degrees) {
+  return degrees * 3.1415926535 / 180;
+}
+
+StopsTable ReadStops(const filesystem::path& dir) {
+  FeedFile file(dir / "stops.txt");
+  const size_t id = file.GetColumn("stop_id");
+  const size_t name = file.GetColumn("stop_name");
+  const size_t latitude = file.GetColumn("stop_lat");
+  const size_t longitude = file.GetColumn("stop_lon");
+  StopsTable table;
+  while (file.Next()) {
+	const double lat = file.GetNumber(latitude), lon = file.GetNumber(longitude);
+	// entrances and other nodes of stations may have no position
+	if (isnan(lat) || isnan(lon)) {
+	  continue;
+	}
+	const uint32_t stop = table.ids.Intern(file.GetField(id));
+	if (stop == table.stops.size()) {
+	  table.stops.emplace_back();
+	}
+	const string_view stop_name = file.GetField(name);
+	table.stops[stop] = {string(stop_name.empty() ? file.GetField(id) : stop_name),
+		Coords{ToRadians(lat), ToRadians(lon)}};
+  }
+  return table;
+}
+
+TripsTable ReadTrips(const filesystem::path& dir) {
+  FeedFile file(dir / "trips.txt");
+  const size_t route = file.GetColumn("route_id");
+  const size_t id = file.GetColumn("trip_id");
+  const auto shape = file.FindColumn("shape_id");
+  TripsTable table;
+  while (file.Next()) {
+	const uint32_t trip = table.ids.Intern(file.GetField(id));
+	if (trip == table.trips.size()) {
+	  table.trips.emplace_back();
+	}
+	table.trips[trip] = {string(file.GetField(route)), string(file.GetField(shape))};
+  }
+  return table;
+}
+
+StopTimesTable ReadStopTimes(const filesystem::path& dir, size_t thread_count) {
+  const FeedFile file(dir / "stop_times.txt");
+  const size_t trip = file.GetColumn("trip_id");
+  const size_t stop = file.GetColumn("stop_id");
+  const size_t sequence = file.GetColumn("stop_sequence");
+  const auto shape_dist = file.FindColumn("shape_dist_traveled");
+  return ReadInParts<StopTimesTable>(file, thread_count, [=](FeedFile& part) {
+	StopTimesTable table;
+	while (part.Next()) {
+	  const optional<size_t> row_sequence = part.GetUnsigned(sequence);
+	  if (!row_sequence || *row_sequence == REJECTED_SEQUENCE) {
+		++table.rejected_rows_count;
+	  }
+	  table.rows.push_back({table.trip_ids.Intern(part.GetField(trip)),
+		  table.stop_ids.Intern(part.GetField(stop)), row_sequence.value_or(REJECTED_SEQUENCE),
+		  part.GetNumber(shape_dist)});
+	}
+	return table;
+  }, [](StopTimesTable& table, StopTimesTable& part) {
+	table.rejected_rows_count += part.rejected_rows_count;
+	const vector<uint32_t> trips = table.trip_ids.InternAll(part.trip_ids);
+	const vector<uint32_t> stops = table.stop_ids.InternAll(part.stop_ids);
+	table.rows.reserve(table.rows.size() + part.rows.size());
+	for (const StopTimeRecord& row: part.rows) {
+	  table.rows.push_back({trips[row.trip], stops[row.stop], row.sequence, row.shape_dist});
+	}
+  });
+}
+
+ShapesTable ReadShapes(const filesystem::path& dir, size_t thread_count) {
+  if (!filesystem::exists(dir / "shapes.txt")) {
+	return {};
+  }
+  const FeedFile file(dir / "shapes.txt");
+  const size_t id = file.GetColumn("shape_id");
+  const size_t latitude = file.GetColumn("shape_pt_lat");
+  const size_t longitude = file.GetColumn("shape_pt_lon");
+  const size_t sequence = file.GetColumn("shape_pt_sequence");
+  ShapesTable table = ReadInParts<ShapesTable>(file, thread_count, [=](FeedFile& part) {
+	ShapesTable table;
+	while (part.Next()) {
+	  const uint32_t shape = table.ids.Intern(part.GetField(id));
+	  if (shape == table.shapes.size()) {
+		table.shapes.emplace_back();
+	  }
+	  const optional<size_t> point_sequence = part.GetUnsigned(sequence);
+	  if (!point_sequence) {
+		++table.rejected_rows_count;
+		continue;
+	  }
+	  table.shapes[shape].push_back({*point_sequence,
+		  Coords{ToRadians(part.GetNumber(latitude)), ToRadians(part.GetNumber(longitude))}});
+	}
+	return table;
+  }, [](ShapesTable& table, ShapesTable& part) {
+	table.rejected_rows_count += part.rejected_rows_count;
+	const vector<uint32_t> shapes = table.ids.InternAll(part.ids);
+	table.shapes.resize(table.ids.Size());
+	for (size_t i = 0; i < shapes.size(); ++i) {
+	  auto& points = table.shapes[shapes[i]];
+	  points.insert(end(points), begin(part.shapes[i]), end(part.shapes[i]));
+	}
+  });
+  for (auto& points: table.shapes) {
+	sort(begin(points), end(points), [](const ShapePoint& lhs, const ShapePoint& rhs) {
+	  return lhs.sequence < rhs.sequence;
+	});
+  }
+  return table;
+}
+
+//------------------Feed Files----------------------------//
+
+//------------------Routes--------------------------------//
+
+// ComputeDistance in double precision, which is plenty for the checks
+// and bounds it is used for here.
+double ComputeGeoDistance(const Coords& lhs, const Coords& rhs) {
+  const double lhs_latitude = lhs.latitude, rhs_latitude = rhs.latitude;
+  const double cosine = sin(lhs_latitude) * sin(rhs_latitude) +
+	  cos(lhs_latitude) * cos(rhs_latitude) * cos(abs(double(lhs.longitude - rhs.longitude)));
+  // coinciding points may give a cosine just above 1
+  return acos(min(1.0, cosine)) * 6371000;
+}
+
+// Road distances between consecutive stops of a trip, in whole meters and
+// never shorter than the straight line.
+vector<double> ComputeSegmentDistances(const vector<Coords>& stops,
+		const vector<double>& shape_dists, const vector<ShapePoint>* shape) {
+  const size_t segments_count = stops.size() - 1;
+  vector<double> geo(segments_count), road(segments_count, 0);
+  double geo_total = 0;
+  for (size_t i = 0; i < segments_count; ++i) {
+	geo_total += geo[i] = ComputeGeoDistance(stops[i], stops[i + 1]);
+  }
+
+  const bool has_shape_dists = all_of(begin(shape_dists), end(shape_dists),
+	  [](double dist) { return !isnan(dist); }) && shape_dists.back() > shape_dists.front();
+  if (has_shape_dists) {
+	// the unit of shape_dist_traveled is up to the feed: the smallest of
+	// meters, kilometers and miles not much shorter than the straight line
+	const double span = shape_dists.back() - shape_dists.front();
+	double unit = 1;
+	for (double candidate: {1.0, 1000.0, 1609.344}) {
+	  unit = candidate;
+	  if (span * unit >= 0.9 * geo_total) {
+		break;
+	  }
+	}
+	for (size_t i = 0; i < segments_count; ++i) {
+	  road[i] = (shape_dists[i + 1] - shape_dists[i]) * unit;
+	}
+  } else if (shape && shape->size() >= 2) {
+	vector<double> along(shape->size(), 0);
+	for (size_t j = 1; j < shape->size(); ++j) {
+	  along[j] = along[j - 1] + ComputeGeoDistance((*shape)[j - 1].coords, (*shape)[j].coords);
+	}
+	// each stop snaps to the nearest shape point not before the previous one
+	vector<size_t> snapped(stops.size());
+	size_t from = 0;
+	for (size_t i = 0; i < stops.size(); ++i) {
+	  double best = numeric_limits<double>::infinity();
+	  for (size_t j = from; j < shape->size(); ++j) {
+		const double distance = ComputeGeoDistance(stops[i], (*shape)[j].coords);
+		if (distance < best) {
+		  best = distance;
+		  snapped[i] = j;
+		}
+	  }
+	  from = snapped[i];
+	}
+	for (size_t i = 0; i < segments_count; ++i) {
+	  road[i] = along[snapped[i + 1]] - along[snapped[i]];
+	}
+  }
+
+  for (size_t i = 0; i < segments_count; ++i) {
+	road[i] = max({round(road[i]), ceil(geo[i]), 1.0});
+  }
+  return road;
+}
+
+struct Pattern {
+  uint32_t route;
+  vector<uint32_t> stops;
+  uint32_t first_trip;
+  size_t trips_count = 0;
+  vector<double> distances;
+};
+
+struct PatternKeyHasher {
+  size_t operator()(const pair<uint32_t, vector<uint32_t>>& key) const {
+	size_t hash = key.first;
+	for (uint32_t stop: key.second) {
+	  hash = hash * 1000003 ^ stop;
+	}
+	return hash;
+  }
+};
+
+// Runs job(first, last) over [0, count) split between thread_count tasks.
+template <typename Job>
+void RunInParallel(size_t count, size_t thread_count, Job job) {
+  const size_t tasks_count = max<size_t>(1, min(thread_count, count));
+  vector<future<void>> tasks;
+  for (size_t task = 0; task < tasks_count; ++task) {
+	tasks.push_back(async(launch::async, job, count * task / tasks_count,
+		count * (task + 1) / tasks_count));
+  }
+  for (auto& task: tasks) {
+	task.get();
+  }
+}
+
+}
+
+GtfsImportStats ImportGtfsFeed(const filesystem::path& dir, RouteManager& rm,
+		const GtfsImportOptions& options) {
+  const auto policy = options.thread_count > 1 ? launch::async : launch::deferred;
+  auto stops_future = async(policy, ReadStops, dir);
+  auto trips_future = async(policy, ReadTrips, dir);
+  auto stop_times_future = async(policy, ReadStopTimes, dir, options.thread_count);
+  auto shapes_future = async(policy, ReadShapes, dir, options.thread_count);
+  const StopsTable stops = stops_future.get();
+  const TripsTable trips = trips_future.get();
+  StopTimesTable stop_times = stop_times_future.get();
+  const ShapesTable shapes = shapes_future.get();
+
+  // stops are keyed by stop_id; one sharing its name with an earlier stop
+  // is told apart by its stop_id
+  NameInterner stop_names;
+  vector<Coords> stop_coords;
+  for (uint32_t i = 0; i < stops.stops.size(); ++i) {
+	const string& name = stops.stops[i].name;
+	string unique_name = name;
+	for (size_t n = 1; stop_names.Find(unique_name); ++n) {
+	  unique_name = name + " (" + stops.ids.GetName(i) + (n > 1 ? "/" + to_string(n) : "") + ")";
+	}
+	stop_names.Intern(unique_name);
+	stop_coords.push_back(stops.stops[i].coords);
+  }
+  vector<uint32_t> row_stops(stop_times.stop_ids.Size(), NONE);
+  for (uint32_t i = 0; i < row_stops.size(); ++i) {
+	if (const auto stop = stops.ids.Find(stop_times.stop_ids.GetName(i))) {
+	  row_stops[i] = *stop;
+	}
+  }
+  const size_t trips_count = stop_times.trip_ids.Size();
+  vector<const TripRecord*> row_trips(trips_count, nullptr);
+  vector<const vector<ShapePoint>*> row_shapes(trips_count, nullptr);
+  for (uint32_t i = 0; i < trips_count; ++i) {
+	if (const auto trip = trips.ids.Find(stop_times.trip_ids.GetName(i))) {
+	  row_trips[i] = &trips.trips[*trip];
+	  if (const auto shape = shapes.ids.Find(row_trips[i]->shape_id)) {
+		row_shapes[i] = &shapes.shapes[*shape];
+	  }
+	}
+  }
+
+  // rows grouped by trip with a counting sort, then ordered within trips
+  vector<size_t> trip_offsets(trips_count + 1, 0);
+  for (const StopTimeRecord& row: stop_times.rows) {
+	++trip_offsets[row.trip + 1];
+  }
+  for (size_t trip = 0; trip < trips_count; ++trip) {
+	trip_offsets[trip + 1] += trip_offsets[trip];
+  }
+  vector<StopTimeRecord> trip_rows(stop_times.rows.size());
+  {
+	vector<size_t> positions(begin(trip_offsets), prev(end(trip_offsets)));
+	for (const StopTimeRecord& row: stop_times.rows) {
+	  trip_rows[positions[row.trip]++] = row;
+	}
+	stop_times.rows = {};
+  }
+  // stop names of a trip with repeats in a row merged; empty if unusable
+  auto collect_trip = [&](size_t trip, vector<uint32_t>& trip_stops,
+	  vector<double>* shape_dists) {
+	trip_stops.clear();
+	if (shape_dists) {
+	  shape_dists->clear();
+	}
+	if (!row_trips[trip]) {
+	  return;
+	}
+	for (size_t i = trip_offsets[trip]; i < trip_offsets[trip + 1]; ++i) {
+	  const uint32_t stop = row_stops[trip_rows[i].stop];
+	  if (stop == NONE || trip_rows[i].sequence == REJECTED_SEQUENCE) {
+		trip_stops.clear();
+		return;
+	  }
+	  if (!trip_stops.empty() && trip_stops.back() == stop) {
+		if (shape_dists) {
+		  shape_dists->back() = trip_rows[i].shape_dist;
+		}
+		continue;
+	  }
+	  trip_stops.push_back(stop);
+	  if (shape_dists) {
+		shape_dists->push_back(trip_rows[i].shape_dist);
+	  }
+	}
+	if (trip_stops.size() < 2) {
+	  trip_stops.clear();
+	}
+  };
+
+  vector<vector<uint32_t>> trip_stops(trips_count);
+  RunInParallel(trips_count, options.thread_count, [&](size_t first, size_t last) {
+	for (size_t trip = first; trip < last; ++trip) {
+	  sort(begin(trip_rows) + trip_offsets[trip], begin(trip_rows) + trip_offsets[trip + 1],
+		  [](const StopTimeRecord& lhs, const StopTimeRecord& rhs) {
+		return lhs.sequence < rhs.sequence;
+	  });
+	  collect_trip(trip, trip_stops[trip], nullptr);
+	}
+  });
+
+  GtfsImportStats stats;
+  stats.stops_count = stop_names.Size();
+  stats.trips_count = trips_count;
+  stats.rejected_rows_count = stop_times.rejected_rows_count + shapes.rejected_rows_count;
+  NameInterner routes;
+  vector<Pattern> patterns;
+  unordered_map<pair<uint32_t, vector<uint32_t>>, size_t, PatternKeyHasher> pattern_ids;
+  for (uint32_t trip = 0; trip < trips_count; ++trip) {
+	if (trip_stops[trip].empty()) {
+	  ++stats.skipped_trips_count;
+	  continue;
+	}
+	const uint32_t route = routes.Intern(row_trips[trip]->route_id);
+	const auto [it, inserted] = pattern_ids.emplace(
+		make_pair(route, move(trip_stops[trip])), patterns.size());
+	if (inserted) {
+	  patterns.push_back({route, it->first.second, trip, 0, {}});
+	}
+	++patterns[it->second].trips_count;
+  }
+  trip_stops = {};
+  pattern_ids.clear();
+
+  RunInParallel(patterns.size(), options.thread_count, [&](size_t first, size_t last) {
+	vector<uint32_t> pattern_stops;
+	vector<double> shape_dists;
+	vector<Coords> coords;
+	for (size_t i = first; i < last; ++i) {
+	  Pattern& pattern = patterns[i];
+	  collect_trip(pattern.first_trip, pattern_stops, &shape_dists);
+	  coords.clear();
+	  for (uint32_t stop: pattern_stops) {
+		coords.push_back(stop_coords[stop]);
+	  }
+	  pattern.distances = ComputeSegmentDistances(coords, shape_dists,
+		  row_shapes[pattern.first_trip]);
+	}
+  });
+
+  // the busiest stop sequence of a route takes the plain route name, the
+  // others the first "/N" suffixes that are not a route_id
+  vector<vector<size_t>> route_patterns(routes.Size());
+  for (size_t i = 0; i < patterns.size(); ++i) {
+	route_patterns[patterns[i].route].push_back(i);
+  }
+  struct Bus {
+	string name;
+	size_t pattern;
+	bool linear;
+  };
+  vector<Bus> buses;
+  unordered_set<string_view> bus_names;
+  for (uint32_t route = 0; route < routes.Size(); ++route) {
+	bus_names.insert(routes.GetName(route));
+  }
+  unordered_map<uint64_t, double> pair_distances;
+  pair_distances.reserve(trip_rows.size() / max<size_t>(1, trips_count) * patterns.size());
+  vector<vector<DistanceToStop>> stop_distances(stop_names.Size());
+  auto add_distances = [&](const Pattern& pattern) {
+	for (size_t i = 0; i + 1 < pattern.stops.size(); ++i) {
+	  const uint32_t from = pattern.stops[i], to = pattern.stops[i + 1];
+	  if (pair_distances.emplace(uint64_t(from) << 32 | to, pattern.distances[i]).second) {
+		stop_distances[from].push_back({pattern.distances[i], stop_names.GetName(to)});
+	  }
+	}
+  };
+  for (uint32_t route = 0; route < routes.Size(); ++route) {
+	vector<size_t>& ids = route_patterns[route];
+	stable_sort(begin(ids), end(ids), [&patterns](size_t lhs, size_t rhs) {
+	  return patterns[lhs].trips_count > patterns[rhs].trips_count;
+	});
+	vector<char> used(ids.size(), false);
+	size_t route_buses_count = 0, next_suffix = 2;
+	for (size_t i = 0; i < ids.size(); ++i) {
+	  if (used[i]) {
+		continue;
+	  }
+	  const Pattern& pattern = patterns[ids[i]];
+	  bool linear = false;
+	  if (pattern.stops.front() != pattern.stops.back()) {
+		for (size_t j = i + 1; j < ids.size() && !linear; ++j) {
+		  const vector<uint32_t>& other = patterns[ids[j]].stops;
+		  if (!used[j] && equal(rbegin(pattern.stops), rend(pattern.stops),
+			  begin(other), end(other))) {
+			used[j] = linear = true;
+			add_distances(pattern);
+			add_distances(patterns[ids[j]]);
+		  }
+		}
+	  }
+	  if (!linear) {
+		add_distances(pattern);
+	  }
+	  const string& route_name = routes.GetName(route);
+	  string name = route_name;
+	  if (++route_buses_count > 1) {
+		do {
+		  name = route_name + "/" + to_string(next_suffix++);
+		} while (bus_names.count(name));
+	  }
+	  buses.push_back({move(name), ids[i], linear});
+	}
+  }
+
+  // RouteManager is filled serially: SetStopData and SetBusData update its
+  // shared maps, and a bus needs all stops in place
+  for (uint32_t stop = 0; stop < stop_names.Size(); ++stop) {
+	rm.SetStopData(stop_names.GetName(stop), stop_coords[stop], stop_distances[stop]);
+  }
+  if (options.locality_layout || options.compact_layout) {
+	rm.BuildStopLayout(options.compact_layout);
+  }
+  vector<string> bus_stops;
+  for (const Bus& bus: buses) {
+	bus_stops.clear();
+	for (uint32_t stop: patterns[bus.pattern].stops) {
+	  bus_stops.push_back(stop_names.GetName(stop));
+	}
+	if (bus.linear) {
+	  rm.SetBusData<NotCycleRoute>(bus.name, bus_stops);
+	} else {
+	  rm.SetBusData<CycleRoute>(bus.name, bus_stops);
+	}
+  }
+  stats.buses_count = buses.size();
+  return stats;
+}
+
+void PrintGtfsImportStats(const GtfsImportStats& stats, ostream& out_stream) {
+  out_stream << "gtfs: " << stats.stops_count << " stops, " << stats.trips_count
+			 << " trips, " << stats.buses_count << " buses";
+  if (stats.skipped_trips_count) {
+	out_stream << ", " << stats.skipped_trips_count << " trips skipped";
+  }
+  if (stats.rejected_rows_count) {
+	out_stream << ", " << stats.rejected_rows_count << " rows rejected";
+  }
+  out_stream << '\n';
+}
+
+//------------------Routes--------------------------------//
+
+void TestCsvScanner() {
+  istringstream input("\xEF\xBB\xBFid, name ,note\r\n"
+					  "1,plain,\r\n"
+					  "\n"
+					  "2,\"quoted, with comma\",\"say \"\"hi\"\"\"\n"
+					  "3,\"two\nlines\",last");
+  CsvScanner scanner(input, 4);
+  ASSERT_EQUAL(*scanner.FindColumn("name"), 1u);
+  ASSERT(!scanner.FindColumn("missing"));
+  ASSERT(scanner.Next());
+  ASSERT_EQUAL(scanner.GetFields(), vector<string_view>({"1", "plain", ""}));
+  ASSERT(scanner.Next());
+  ASSERT_EQUAL(scanner.GetFields(), vector<string_view>({"2", "quoted, with comma",
+	  "say \"hi\""}));
+  ASSERT(scanner.Next());
+  ASSERT_EQUAL(scanner.GetFields(), vector<string_view>({"3", "two\nlines", "last"}));
+  ASSERT_EQUAL(scanner.GetField(7), "");
+  ASSERT(!scanner.Next());
+}
+
+void TestGtfsImport() {
+  const filesystem::path dir = filesystem::temp_directory_path() /
+	  ("gtfs-test-" + to_string(random_device()()));
+  filesystem::create_directories(dir);
+  ofstream(dir / "stops.txt") << "stop_id,stop_name,stop_lat,stop_lon\n"
+	  << "1,Tolstopaltsevo,55.611087,37.20829\n"
+	  << "2,Marushkino,55.595884,37.209755\n"
+	  << "3,\"Rasskazovka\",55.632761,37.333324\n"
+	  << "4,Extra,55.64,37.34\n"
+	  << "5,\"Pushkin \"\"Square\"\", exit 2\",55.7,37.6\n"
+	  << "6,Marushkino,55.5,37.1\n";
+  ofstream(dir / "trips.txt") << "route_id,service_id,trip_id,shape_id\n"
+	  << "750,all,t1,\n750,all,t2,\n750,all,t5,\nC,all,t3,\nO,all,t4,s1\nX,all,t6,\n"
+	  << "O,all,t7,\nO/2,all,t8,\nY,all,t9,\n";
+  ofstream(dir / "stop_times.txt") << "trip_id,stop_id,stop_sequence,shape_dist_traveled\n"
+	  << "t1,1,1,0\nt1,2,2,3.9\nt1,3,3,13.8\n"
+	  << "t2,1,3,13.8\nt2,2,2,9.9\nt2,3,1,0\n"
+	  << "t5,1,1,0\nt5,2,2,3.9\nt5,3,3,13.8\n"
+	  << "t3,1,1,\nt3,2,2,\nt3,1,3,\n"
+	  << "t4,3,1,\nt4,4,2,\n"
+	  << "t6,1,1,\nt6,99,2,\n"
+	  << "t7,4,1,\nt7,6,2,\n"
+	  << "t8,1,1,\nt8,6,2,\n"
+	  << "t9,1,1,\nt9,2,nan,\n";
+  ofstream(dir / "shapes.txt") << "shape_id,shape_pt_lat,shape_pt_lon,shape_pt_sequence\n"
+	  << "s1,55.64,37.34,3\ns1,55.632761,37.333324,1\ns1,55.64,37.333324,2\n"
+	  << "s1,0,0,2.5\n";
+
+  RouteManager manager;
+  const GtfsImportStats stats = ImportGtfsFeed(dir, manager, {2, false});
+  filesystem::remove_all(dir);
+  ASSERT_EQUAL(stats.stops_count, 6u);
+  ASSERT_EQUAL(stats.trips_count, 9u);
+  // t9 has a stop_sequence that is not a number, s1 a point
+  ASSERT_EQUAL(stats.skipped_trips_count, 2u);
+  ASSERT_EQUAL(stats.rejected_rows_count, 2u);
+  ASSERT_EQUAL(stats.buses_count, 5u);
+
+  {
+	const BusStats bus = *manager.GetBusStats("750");
+	ASSERT_EQUAL(bus.stop_count, 5);
+	ASSERT_EQUAL(bus.unique_stop_count, 3);
+	ASSERT_EQUAL(bus.route_distance, 27600);
+	ostringstream os;
+	os.precision(6);
+	os << bus.curvature;
+	ASSERT_EQUAL(os.str(), "1.31808");
+  }
+  {
+	const BusStats bus = *manager.GetBusStats("C");
+	ASSERT_EQUAL(bus.stop_count, 3);
+	ASSERT_EQUAL(bus.unique_stop_count, 2);
+	ASSERT_EQUAL(bus.route_distance, 7800);
+  }
+  {
+	const BusStats bus = *manager.GetBusStats("O");
+	ASSERT_EQUAL(bus.stop_count, 2);
+	ASSERT(bus.curvature > 1);
+  }
+  ASSERT(!manager.GetBusStats("750/2"));
+  ASSERT(!manager.GetBusStats("X"));
+  ASSERT(!manager.GetBusStats("Y"));
+  ASSERT_EQUAL(*manager.GetStopStats("Marushkino"), set<string>({"750", "C"}));
+  // the second Marushkino is another stop, and the second stop sequence
+  // of O skips the route O/2
+  ASSERT_EQUAL(*manager.GetStopStats("Marushkino (6)"), set<string>({"O/2", "O/3"}));
+  ASSERT_EQUAL(manager.GetBusStats("O/2")->stop_count, 2);
+  ASSERT(manager.GetStopStats("Pushkin \"Square\", exit 2")->empty());
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "RouteManager.h"
+
+//---------------------GTFS Import-----------------------------//
+
+// Splits CSV records (RFC 4180) read from a stream in large chunks. The
+// first record is taken as the header unless has_header is false. Fields
+// are views into the chunk buffer and quoted fields are unescaped in
+// place, so records cost no allocations; the views stay valid until the
+// next call of Next.
+class CsvScanner {
+public:
+  explicit CsvScanner(std::istream& input, size_t chunk_size = 1 << 20,
+		  bool has_header = true);
+
+  bool Next();
+
+  // Offsets from the scan start: of the last record read and of the
+  // first byte not read yet.
+  size_t GetRecordOffset() const {
+	return record_offset;
+  }
+
+  size_t GetOffset() const {
+	return buffer_offset + data_begin;
+  }
+
+  const std::vector<std::string_view>& GetFields() const {
+	return fields;
+  }
+
+  // Empty for a missing column or a short record.
+  std::string_view GetField(std::optional<size_t> column) const {
+	return column && *column < fields.size() ? fields[*column] : std::string_view();
+  }
+
+  std::optional<size_t> FindColumn(std::string_view name) const;
+
+private:
+  bool FindRecordEnd(size_t& record_end);
+  void SplitRecord(size_t record_end);
+
+  std::istream& input;
+  std::vector<char> buffer;
+  size_t data_begin = 0;
+  size_t data_end = 0;
+  size_t buffer_offset = 0;
+  size_t record_offset = 0;
+  bool input_done = false;
+  std::vector<std::string_view> fields;
+  std::vector<std::string> header;
+};
+
+struct GtfsImportOptions {
+  size_t thread_count = 1;
+  bool locality_layout = false;
+  bool compact_layout = false;
+};
+
+struct GtfsImportStats {
+  size_t stops_count = 0;
+  size_t trips_count = 0;
+  size_t skipped_trips_count = 0;
+  // rows whose stop_sequence or shape_pt_sequence is not an unsigned
+  // integer; the trip of such a stop_times row is skipped
+  size_t rejected_rows_count = 0;
+  size_t buses_count = 0;
+};
+
+// Fills rm straight from the stops.txt, trips.txt, stop_times.txt and,
+// when present, shapes.txt files of a GTFS feed; the files are scanned,
+// and the trips grouped and measured, in parallel. Stops are keyed by
+// stop_id and named by stop_name, with " (stop_id)" added to a name an
+// earlier stop already has. Trips with the same route_id and stop sequence
+// make one bus named after the route, with the first "/N" suffixes that
+// are not a route_id for its further stop sequences: a closed or one-way
+// sequence becomes a cycle route, a sequence whose reverse is also run
+// becomes a linear one. RouteManager itself is filled serially. Road
+// distances come from shape_dist_traveled, else from the trip shape, else
+// from the straight line between the stops.
+// Throws runtime_error for a missing file or column.
+GtfsImportStats ImportGtfsFeed(const std::filesystem::path& dir, RouteManager& rm,
+		const GtfsImportOptions& options);
+
+void PrintGtfsImportStats(const GtfsImportStats& stats, std::ostream& out_stream);
+
+//---------------------GTFS Import-----------------------------//
+
+//---------------------Tests-----------------------------------//
+void TestCsvScanner();
+void TestGtfsImport();
+//---------------------Tests-----------------------------------//
@@ -0,0 +1,211 @@
+#include "Reachability.h"
+#include <algorithm>
+#include <future>
+#include "test_runner.h"
+
+using namespace std;
+
+namespace {
+
+template <typename Word, typename Callback>
+void ForEachSetBit(Word word, size_t base, Callback callback) {
+  while (word) {
+	callback(base + __builtin_ctzll(word));
+	word &= word - 1;
+  }
+}
+
+}
+
+ReachabilityIndex::ReachabilityIndex(const RouteManager& rm, size_t thread_count_)
+  : thread_count(max<size_t>(1, thread_count_)) {
+  for (const auto& [stop_name, stop]: rm.GetStopDataBase()) {
+	stop_names.push_back(stop_name);
+  }
+  sort(begin(stop_names), end(stop_names));
+  for (size_t i = 0; i < stop_names.size(); ++i) {
+	stop_ids[stop_names[i]] = i;
+  }
+
+  vector<string_view> bus_names;
+  for (const auto& [bus_name, stats]: rm.GetAllBusStats()) {
+	bus_names.push_back(bus_name);
+  }
+  sort(begin(bus_names), end(bus_names));
+  unordered_map<string_view, size_t> bus_ids;
+  for (size_t i = 0; i < bus_names.size(); ++i) {
+	bus_ids[bus_names[i]] = i;
+  }
+
+  const auto& stop_db = rm.GetStopDataBase();
+  vector<size_t> bus_stops_count(bus_names.size());
+  stop_bus_offsets.reserve(stop_names.size() + 1);
+  stop_bus_offsets.push_back(0);
+  for (string_view stop_name: stop_names) {
+	for (const string& bus_name: stop_db.find(string(stop_name))->second.GetBuses()) {
+	  const size_t bus_id = bus_ids.at(bus_name);
+	  stop_buses.push_back(bus_id);
+	  ++bus_stops_count[bus_id];
+	}
+	stop_bus_offsets.push_back(stop_buses.size());
+  }
+
+  bus_stop_offsets.assign(bus_names.size() + 1, 0);
+  for (size_t bus_id = 0; bus_id < bus_names.size(); ++bus_id) {
+	bus_stop_offsets[bus_id + 1] = bus_stop_offsets[bus_id] + bus_stops_count[bus_id];
+  }
+  bus_stops.resize(stop_buses.size());
+  vector<size_t> positions(begin(bus_stop_offsets), prev(end(bus_stop_offsets)));
+
+  words_count = (stop_names.size() + WORD_BITS - 1) / WORD_BITS;
+  bus_masks.assign(bus_names.size() * words_count, 0);
+  for (size_t stop_id = 0; stop_id < stop_names.size(); ++stop_id) {
+	for (size_t i = stop_bus_offsets[stop_id]; i < stop_bus_offsets[stop_id + 1]; ++i) {
+	  const size_t bus_id = stop_buses[i];
+	  bus_stops[positions[bus_id]++] = stop_id;
+	  bus_masks[bus_id * words_count + stop_id / WORD_BITS] |= Word(1) << (stop_id % WORD_BITS);
+	}
+  }
+}
+
+optional<vector<string_view>> ReachabilityIndex::ReachableStops(string_view stop_name,
+		size_t max_buses) const {
+  const auto it = stop_ids.find(stop_name);
+  if (it == stop_ids.end()) {
+	return nullopt;
+  }
+  const size_t source = it->second;
+  vector<Word> reached(words_count), frontier(words_count), next(words_count);
+  vector<char> bus_used(bus_stop_offsets.size() - 1);
+  reached[source / WORD_BITS] = frontier[source / WORD_BITS] = Word(1) << (source % WORD_BITS);
+
+  for (size_t ride = 0; ride < max_buses; ++ride) {
+	next = reached;
+	bool expanded = false;
+	for (size_t w = 0; w < words_count; ++w) {
+	  ForEachSetBit(frontier[w], w * WORD_BITS, [&](size_t stop_id) {
+		for (size_t i = stop_bus_offsets[stop_id]; i < stop_bus_offsets[stop_id + 1]; ++i) {
+		  const size_t bus_id = stop_buses[i];
+		  if (bus_used[bus_id]) {
+			continue;
+		  }
+		  bus_used[bus_id] = true;
+		  expanded = true;
+		  const Word* mask = GetBusMask(bus_id);
+		  for (size_t j = 0; j < words_count; ++j) {
+			next[j] |= mask[j];
+		  }
+		}
+	  });
+	}
+	if (!expanded) {
+	  break;
+	}
+	for (size_t w = 0; w < words_count; ++w) {
+	  frontier[w] = next[w] & ~reached[w];
+	}
+	swap(reached, next);
+  }
+
+  vector<string_view> result;
+  for (size_t w = 0; w < words_count; ++w) {
+	ForEachSetBit(reached[w], w * WORD_BITS, [&](size_t stop_id) {
+	  if (stop_id != source) {
+		result.push_back(stop_names[stop_id]);
+	  }
+	});
+  }
+  return result;
+}
+
+void ReachabilityIndex::CountReachableFromBatch(size_t first_stop, size_t max_buses,
+		vector<size_t>& counts) const {
+  const size_t stops_count = stop_names.size();
+  const size_t last_stop = min(stops_count, first_stop + WORD_BITS);
+  // bit i of a word belongs to the search started from stop first_stop + i
+  vector<Word> seen(stops_count), frontier(stops_count), bus_words(bus_stop_offsets.size() - 1);
+  for (size_t stop_id = first_stop; stop_id < last_stop; ++stop_id) {
+	seen[stop_id] = frontier[stop_id] = Word(1) << (stop_id - first_stop);
+  }
+
+  for (size_t ride = 0; ride < max_buses; ++ride) {
+	for (size_t bus_id = 0; bus_id < bus_words.size(); ++bus_id) {
+	  Word word = 0;
+	  for (size_t i = bus_stop_offsets[bus_id]; i < bus_stop_offsets[bus_id + 1]; ++i) {
+		word |= frontier[bus_stops[i]];
+	  }
+	  bus_words[bus_id] = word;
+	}
+	Word expanded = 0;
+	for (size_t stop_id = 0; stop_id < stops_count; ++stop_id) {
+	  Word word = 0;
+	  for (size_t i = stop_bus_offsets[stop_id]; i < stop_bus_offsets[stop_id + 1]; ++i) {
+		word |= bus_words[stop_buses[i]];
+	  }
+	  frontier[stop_id] = word & ~seen[stop_id];
+	  seen[stop_id] |= word;
+	  expanded |= frontier[stop_id];
+	}
+	if (!expanded) {
+	  break;
+	}
+  }
+
+  for (size_t stop_id = 0; stop_id < stops_count; ++stop_id) {
+	ForEachSetBit(seen[stop_id], first_stop, [&counts](size_t source) {
+	  ++counts[source];
+	});
+  }
+  for (size_t stop_id = first_stop; stop_id < last_stop; ++stop_id) {
+	--counts[stop_id];
+  }
+}
+
+vector<size_t> ReachabilityIndex::CountReachableFromAll(size_t max_buses) const {
+  vector<size_t> counts(stop_names.size());
+  const size_t batches_count = (stop_names.size() + WORD_BITS - 1) / WORD_BITS;
+  const size_t workers_count = min(thread_count, batches_count);
+  // batches write disjoint ranges of counts
+  vector<future<void>> workers;
+  for (size_t worker = 0; worker < workers_count; ++worker) {
+	workers.push_back(async(launch::async, [this, worker, workers_count, batches_count,
+		max_buses, &counts] {
+	  for (size_t batch = worker; batch < batches_count; batch += workers_count) {
+		CountReachableFromBatch(batch * WORD_BITS, max_buses, counts);
+	  }
+	}));
+  }
+  for (auto& worker: workers) {
+	worker.get();
+  }
+  return counts;
+}
+
+void TestReachability() {
+  RouteManager manager;
+  // A - B - C by bus 1, C - D by bus 2, D - E by bus 3, F has no buses
+  for (string stop_name: {"A", "B", "C", "D", "E", "F"}) {
+	manager.SetStopData(stop_name, Coords{0, 0}, {});
+  }
+  manager.SetStopData("A", Coords{0, 0.001}, vector<DistanceToStop>({{200, "B"}}));
+  manager.SetStopData("B", Coords{0, 0.002}, vector<DistanceToStop>({{200, "C"}}));
+  manager.SetStopData("C", Coords{0, 0.003}, vector<DistanceToStop>({{200, "D"}}));
+  manager.SetStopData("D", Coords{0, 0.004}, vector<DistanceToStop>({{200, "E"}}));
+  manager.SetBusData<NotCycleRoute>("1", {"A", "B", "C"});
+  manager.SetBusData<NotCycleRoute>("2", {"C", "D"});
+  manager.SetBusData<CycleRoute>("3", {"D", "E", "D"});
+
+  const ReachabilityIndex index(manager, 2);
+  ASSERT_EQUAL(index.GetStopNames(), vector<string_view>({"A", "B", "C", "D", "E", "F"}));
+  ASSERT(!index.ReachableStops("G", 1));
+  ASSERT(index.ReachableStops("A", 0)->empty());
+  ASSERT_EQUAL(*index.ReachableStops("A", 1), vector<string_view>({"B", "C"}));
+  ASSERT_EQUAL(*index.ReachableStops("A", 2), vector<string_view>({"B", "C", "D"}));
+  ASSERT_EQUAL(*index.ReachableStops("A", 10), vector<string_view>({"B", "C", "D", "E"}));
+  ASSERT_EQUAL(*index.ReachableStops("D", 1), vector<string_view>({"C", "E"}));
+  ASSERT(index.ReachableStops("F", 3)->empty());
+
+  ASSERT_EQUAL(index.CountReachableFromAll(0), vector<size_t>({0, 0, 0, 0, 0, 0}));
+  ASSERT_EQUAL(index.CountReachableFromAll(1), vector<size_t>({2, 2, 3, 2, 1, 0}));
+  ASSERT_EQUAL(index.CountReachableFromAll(2), vector<size_t>({3, 3, 4, 4, 2, 0}));
+}
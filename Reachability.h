@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "RouteManager.h"
+
+//---------------------Reachability----------------------------//
+
+// The stop/bus bipartite graph with every bus stored as a bitset over stops.
+// A search expands the reached set one bus ride at a time by OR-ing the
+// masks of the buses that serve the current frontier. Names point into the
+// RouteManager, which must outlive the index.
+class ReachabilityIndex {
+public:
+  ReachabilityIndex(const RouteManager& rm, size_t thread_count);
+
+  // Stops other than stop_name reachable from it riding at most max_buses
+  // buses, in name order; nullopt for an unknown stop.
+  std::optional<std::vector<std::string_view>> ReachableStops(std::string_view stop_name,
+		  size_t max_buses) const;
+
+  // For every stop of GetStopNames() the number of other stops reachable
+  // riding at most max_buses buses. Runs a multi-source search over 64
+  // sources at once, one bit per source in a word per stop.
+  std::vector<size_t> CountReachableFromAll(size_t max_buses) const;
+
+  const std::vector<std::string_view>& GetStopNames() const {
+	return stop_names;
+  }
+
+private:
+  using Word = uint64_t;
+  static const size_t WORD_BITS = 64;
+
+  const Word* GetBusMask(size_t bus_id) const {
+	return bus_masks.data() + bus_id * words_count;
+  }
+
+  void CountReachableFromBatch(size_t first_stop, size_t max_buses,
+		  std::vector<size_t>& counts) const;
+
+  size_t thread_count;
+  size_t words_count;
+  std::vector<std::string_view> stop_names;
+  std::unordered_map<std::string_view, size_t> stop_ids;
+  // buses of stop i are stop_buses[stop_bus_offsets[i] .. stop_bus_offsets[i + 1])
+  std::vector<size_t> stop_bus_offsets;
+  std::vector<size_t> stop_buses;
+  std::vector<size_t> bus_stop_offsets;
+  std::vector<size_t> bus_stops;
+  std::vector<Word> bus_masks;
+};
+
+//---------------------Reachability----------------------------//
+
+//---------------------Tests-----------------------------------//
+void TestReachability();
+//---------------------Tests-----------------------------------//
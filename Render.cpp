@@ -0,0 +1,455 @@
+#include "Render.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <unordered_set>
+#include "test_runner.h"
+
+using namespace std;
+
+namespace {
+
+const double PI = 3.14159265358979323846;
+const int TILE_SIZE = 256;
+const double LINE_WIDTH = 3;
+const double STOP_RADIUS = 3;
+// bumped whenever tiles are drawn differently, so cached ones get redrawn
+const uint64_t RENDER_VERSION = 1;
+
+enum TileState : char {
+  TILE_CACHED,
+  TILE_RENDERED,
+  TILE_FAILED,
+};
+
+const string_view PALETTE[] = {"#e6194b", "#3cb44b", "#4363d8", "#f58231", "#911eb4",
+	"#42d4f4", "#f032e6", "#9a6324", "#800000", "#000075"};
+
+// FNV-1a, which unlike std::hash stays the same between builds, as the
+// tile manifest must.
+class Fnv1aHasher {
+public:
+  void Add(const void* data, size_t size) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+	  hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+  }
+
+  void Add(string_view str) {
+	const uint64_t size = str.size();
+	Add(&size, sizeof(size));
+	Add(str.data(), str.size());
+  }
+
+  template <typename Value>
+  void AddValue(Value value) {
+	Add(&value, sizeof(value));
+  }
+
+  uint64_t Get() const {
+	return hash;
+  }
+
+private:
+  uint64_t hash = 14695981039346656037ull;
+};
+
+uint64_t MakeTileKey(int zoom, uint32_t x, uint32_t y) {
+  return uint64_t(zoom) << 56 | uint64_t(x) << 28 | y;
+}
+
+void SplitTileKey(uint64_t key, int& zoom, uint32_t& x, uint32_t& y) {
+  zoom = key >> 56;
+  x = (key >> 28) & ((1u << 28) - 1);
+  y = key & ((1u << 28) - 1);
+}
+
+filesystem::path GetTilePath(const filesystem::path& dir, int zoom, uint32_t x, uint32_t y) {
+  return dir / to_string(zoom) / to_string(x) / (to_string(y) + ".svg");
+}
+
+string EscapeXml(string_view text) {
+  string result;
+  for (char c: text) {
+	switch (c) {
+	  case '&': result += "&amp;"; break;
+	  case '<': result += "&lt;"; break;
+	  case '>': result += "&gt;"; break;
+	  case '"': result += "&quot;"; break;
+	  default: result += c;
+	}
+  }
+  return result;
+}
+
+unordered_map<uint64_t, uint64_t> ReadManifest(const filesystem::path& path) {
+  unordered_map<uint64_t, uint64_t> hashes;
+  ifstream input(path);
+  int zoom;
+  uint32_t x, y;
+  uint64_t hash;
+  while (input >> zoom >> x >> y >> hex >> hash >> dec) {
+	hashes[MakeTileKey(zoom, x, y)] = hash;
+  }
+  return hashes;
+}
+
+}
+
+pair<double, double> ProjectToWebMercator(const Coords& coords) {
+  const double latitude = coords.latitude, longitude = coords.longitude;
+  return {(longitude + PI) / (2 * PI) * TILE_SIZE,
+	  (1 - asinh(tan(latitude)) / PI) / 2 * TILE_SIZE};
+}
+
+void MapRenderer::AddStop(const string& stop_name, const Coords& coords) {
+  const auto [x, y] = ProjectToWebMercator(coords);
+  const auto [it, inserted] = stop_ids.emplace(stop_name, stops.size());
+  if (inserted) {
+	stops.push_back({stop_name, {x, y}});
+  } else {
+	stops[it->second].position = {x, y};
+  }
+}
+
+void MapRenderer::AddBus(const string& bus_name, const vector<string>& stop_names) {
+  Fnv1aHasher hasher;
+  hasher.Add(bus_name);
+  Bus bus{bus_name, PALETTE[hasher.Get() % size(PALETTE)], {}};
+  for (const string& stop_name: stop_names) {
+	bus.stops.push_back(stop_ids.at(stop_name));
+  }
+  buses.push_back(move(bus));
+}
+
+MapRenderer::ZoomGrid MapRenderer::BuildZoomGrid(int zoom, int max_zoom) const {
+  const double scale = uint64_t(1) << zoom;
+  const int64_t last_tile = (int64_t(1) << zoom) - 1;
+  auto tile_of = [last_tile](double pixel) {
+	return clamp<int64_t>(floor(pixel / TILE_SIZE), 0, last_tile);
+  };
+  ZoomGrid result{zoom, max_zoom, {}};
+  TileGrid& grid = result.tiles;
+  for (uint32_t bus_id = 0; bus_id < buses.size(); ++bus_id) {
+	const vector<uint32_t>& bus_stops = buses[bus_id].stops;
+	for (uint32_t i = 0; i + 1 < bus_stops.size(); ++i) {
+	  const Point from = stops[bus_stops[i]].position, to = stops[bus_stops[i + 1]].position;
+	  const double x1 = from.x * scale, y1 = from.y * scale;
+	  const double x2 = to.x * scale, y2 = to.y * scale;
+	  // the segment is clipped to each tile column it crosses, and only the
+	  // tiles of the column its clipped part spans get it
+	  const int64_t first_column = tile_of(min(x1, x2) - LINE_WIDTH);
+	  const int64_t last_column = tile_of(max(x1, x2) + LINE_WIDTH);
+	  for (int64_t column = first_column; column <= last_column; ++column) {
+		double t_begin = 0, t_end = 1;
+		if (x1 != x2) {
+		  const double t_left = (column * TILE_SIZE - LINE_WIDTH - x1) / (x2 - x1);
+		  const double t_right = ((column + 1) * TILE_SIZE + LINE_WIDTH - x1) / (x2 - x1);
+		  t_begin = max(t_begin, min(t_left, t_right));
+		  t_end = min(t_end, max(t_left, t_right));
+		  if (t_begin > t_end) {
+			continue;
+		  }
+		}
+		const double y_begin = y1 + (y2 - y1) * t_begin, y_end = y1 + (y2 - y1) * t_end;
+		const int64_t last_row = tile_of(max(y_begin, y_end) + LINE_WIDTH);
+		for (int64_t row = tile_of(min(y_begin, y_end) - LINE_WIDTH); row <= last_row; ++row) {
+		  grid[MakeTileKey(zoom, column, row)].segments.push_back({bus_id, i});
+		}
+	  }
+	}
+  }
+  if (zoom >= max_zoom - 2) {
+	for (uint32_t stop_id = 0; stop_id < stops.size(); ++stop_id) {
+	  const double x = stops[stop_id].position.x * scale, y = stops[stop_id].position.y * scale;
+	  const int64_t last_column = tile_of(x + STOP_RADIUS), last_row = tile_of(y + STOP_RADIUS);
+	  for (int64_t column = tile_of(x - STOP_RADIUS); column <= last_column; ++column) {
+		for (int64_t row = tile_of(y - STOP_RADIUS); row <= last_row; ++row) {
+		  grid[MakeTileKey(zoom, column, row)].stops.push_back(stop_id);
+		}
+	  }
+	}
+  }
+  return result;
+}
+
+uint64_t MapRenderer::HashTile(int zoom, const TileContent& content, int max_zoom) const {
+  Fnv1aHasher hasher;
+  hasher.AddValue(RENDER_VERSION);
+  hasher.AddValue(zoom >= max_zoom);
+  for (const auto& [bus_id, i]: content.segments) {
+	const Bus& bus = buses[bus_id];
+	hasher.Add(bus.name);
+	hasher.Add(bus.color);
+	hasher.AddValue(stops[bus.stops[i]].position.x);
+	hasher.AddValue(stops[bus.stops[i]].position.y);
+	hasher.AddValue(stops[bus.stops[i + 1]].position.x);
+	hasher.AddValue(stops[bus.stops[i + 1]].position.y);
+  }
+  for (uint32_t stop_id: content.stops) {
+	hasher.Add(stops[stop_id].name);
+	hasher.AddValue(stops[stop_id].position.x);
+	hasher.AddValue(stops[stop_id].position.y);
+  }
+  return hasher.Get();
+}
+
+string MapRenderer::RenderTile(int zoom, uint32_t x, uint32_t y, const TileContent& content,
+		int max_zoom) const {
+  const double scale = uint64_t(1) << zoom;
+  ostringstream out;
+  out << fixed << setprecision(1);
+  auto print_point = [&](const Point& point) {
+	out << point.x * scale - double(x) * TILE_SIZE << ' '
+		<< point.y * scale - double(y) * TILE_SIZE;
+  };
+
+  out << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << TILE_SIZE
+	  << "\" height=\"" << TILE_SIZE << "\" viewBox=\"0 0 " << TILE_SIZE << ' ' << TILE_SIZE
+	  << "\">\n";
+  // segments come bus by bus in route order, so a bus is one path
+  for (size_t i = 0; i < content.segments.size(); ++i) {
+	const auto [bus_id, stop_index] = content.segments[i];
+	const Bus& bus = buses[bus_id];
+	const bool new_bus = i == 0 || content.segments[i - 1].first != bus_id;
+	if (new_bus) {
+	  out << "<path fill=\"none\" stroke=\"" << bus.color << "\" stroke-width=\"" << LINE_WIDTH
+		  << "\" stroke-linecap=\"round\" stroke-linejoin=\"round\" d=\"";
+	}
+	if (new_bus || content.segments[i - 1].second + 1 != stop_index) {
+	  out << (new_bus ? "M" : " M");
+	  print_point(stops[bus.stops[stop_index]].position);
+	}
+	out << " L";
+	print_point(stops[bus.stops[stop_index + 1]].position);
+	if (i + 1 == content.segments.size() || content.segments[i + 1].first != bus_id) {
+	  out << "\"/>\n";
+	}
+  }
+  for (uint32_t stop_id: content.stops) {
+	out << "<circle cx=\"" << stops[stop_id].position.x * scale - double(x) * TILE_SIZE
+		<< "\" cy=\"" << stops[stop_id].position.y * scale - double(y) * TILE_SIZE
+		<< "\" r=\"" << STOP_RADIUS << "\" fill=\"white\" stroke=\"black\"/>\n";
+  }
+  if (zoom >= max_zoom) {
+	for (uint32_t stop_id: content.stops) {
+	  out << "<text x=\"" << stops[stop_id].position.x * scale - double(x) * TILE_SIZE + 5
+		  << "\" y=\"" << stops[stop_id].position.y * scale - double(y) * TILE_SIZE - 5
+		  << "\" font-family=\"sans-serif\" font-size=\"10\">" << EscapeXml(stops[stop_id].name)
+		  << "</text>\n";
+	}
+  }
+  out << "</svg>\n";
+  return out.str();
+}
+
+string MapRenderer::RenderTile(const ZoomGrid& grid, uint32_t x, uint32_t y) const {
+  const auto it = grid.tiles.find(MakeTileKey(grid.zoom, x, y));
+  return RenderTile(grid.zoom, x, y, it != grid.tiles.end() ? it->second : TileContent{},
+	  grid.max_zoom);
+}
+
+TileRenderStats MapRenderer::RenderTiles(const TileRenderOptions& options) const {
+  const launch policy = options.thread_count > 1 ? launch::async : launch::deferred;
+  const filesystem::path manifest_path = options.dir / "manifest";
+  const auto old_hashes = ReadManifest(manifest_path);
+  TileRenderStats stats;
+  // hash 0 marks a tile whose file is in an unknown state, so the next run
+  // writes or removes it again
+  vector<pair<uint64_t, uint64_t>> new_hashes;
+
+  // one zoom at a time, so only one grid is held
+  for (int zoom = options.min_zoom; zoom <= options.max_zoom; ++zoom) {
+	const ZoomGrid grid = BuildZoomGrid(zoom, options.max_zoom);
+	vector<pair<uint64_t, const TileContent*>> tiles;
+	tiles.reserve(grid.tiles.size());
+	for (const auto& [key, content]: grid.tiles) {
+	  tiles.push_back({key, &content});
+	}
+	sort(begin(tiles), end(tiles));
+
+	// directories are made up front, so the tasks only write files; a
+	// directory that cannot be made fails its tiles below
+	for (size_t i = 0; i < tiles.size(); ++i) {
+	  int tile_zoom;
+	  uint32_t x, y;
+	  SplitTileKey(tiles[i].first, tile_zoom, x, y);
+	  if (i == 0 || tiles[i].first >> 28 != tiles[i - 1].first >> 28) {
+		error_code ec;
+		filesystem::create_directories(
+			GetTilePath(options.dir, tile_zoom, x, y).parent_path(), ec);
+	  }
+	}
+
+	vector<uint64_t> hashes(tiles.size());
+	vector<char> states(tiles.size(), TILE_CACHED);
+	const size_t tasks_count = max<size_t>(1, min(options.thread_count, tiles.size()));
+	vector<future<void>> tasks;
+	for (size_t task = 0; task < tasks_count; ++task) {
+	  tasks.push_back(async(policy, [&, task] {
+		for (size_t i = tiles.size() * task / tasks_count;
+			i < tiles.size() * (task + 1) / tasks_count; ++i) {
+		  int tile_zoom;
+		  uint32_t x, y;
+		  SplitTileKey(tiles[i].first, tile_zoom, x, y);
+		  hashes[i] = HashTile(tile_zoom, *tiles[i].second, options.max_zoom);
+		  const filesystem::path path = GetTilePath(options.dir, tile_zoom, x, y);
+		  const auto old_hash = old_hashes.find(tiles[i].first);
+		  try {
+			if (old_hash != old_hashes.end() && old_hash->second == hashes[i] &&
+				filesystem::exists(path)) {
+			  continue;
+			}
+			// a tile is replaced whole, never left half written
+			filesystem::path temp_path = path;
+			temp_path += ".new";
+			{
+			  ofstream out(temp_path);
+			  out << RenderTile(tile_zoom, x, y, *tiles[i].second, options.max_zoom);
+			  if (!out.flush()) {
+				throw filesystem::filesystem_error("cannot write tile", temp_path,
+					make_error_code(errc::io_error));
+			  }
+			}
+			filesystem::rename(temp_path, path);
+			states[i] = TILE_RENDERED;
+		  } catch (const filesystem::filesystem_error&) {
+			states[i] = TILE_FAILED;
+		  }
+		}
+	  }));
+	}
+	for (auto& task: tasks) {
+	  task.get();
+	}
+
+	for (size_t i = 0; i < tiles.size(); ++i) {
+	  stats.rendered_count += states[i] == TILE_RENDERED;
+	  stats.cached_count += states[i] == TILE_CACHED;
+	  stats.failed_count += states[i] == TILE_FAILED;
+	  new_hashes.push_back({tiles[i].first, states[i] == TILE_FAILED ? 0 : hashes[i]});
+	}
+  }
+
+  // tiles are keyed zoom first, so new_hashes is sorted
+  for (const auto& [key, hash]: old_hashes) {
+	const auto it = lower_bound(begin(new_hashes), end(new_hashes), make_pair(key, uint64_t(0)));
+	if (it != end(new_hashes) && it->first == key) {
+	  continue;
+	}
+	int zoom;
+	uint32_t x, y;
+	SplitTileKey(key, zoom, x, y);
+	error_code ec;
+	filesystem::remove(GetTilePath(options.dir, zoom, x, y), ec);
+	if (ec) {
+	  ++stats.failed_count;
+	  new_hashes.insert(it, {key, 0});
+	} else {
+	  ++stats.removed_count;
+	}
+  }
+
+  // the manifest is replaced last and whole, so it never lists a tile the
+  // way it is not on disk
+  const filesystem::path new_manifest_path = options.dir / "manifest.new";
+  {
+	ofstream manifest(new_manifest_path);
+	for (const auto& [key, hash]: new_hashes) {
+	  int zoom;
+	  uint32_t x, y;
+	  SplitTileKey(key, zoom, x, y);
+	  manifest << zoom << ' ' << x << ' ' << y << ' ' << hex << hash << dec << '\n';
+	}
+	if (!manifest.flush()) {
+	  throw runtime_error("cannot write " + new_manifest_path.string());
+	}
+  }
+  filesystem::rename(new_manifest_path, manifest_path);
+  return stats;
+}
+
+void PrintTileRenderStats(const TileRenderStats& stats, ostream& out_stream) {
+  out_stream << "tiles: " << stats.rendered_count << " rendered, " << stats.cached_count
+			 << " cached, " << stats.removed_count << " removed";
+  if (stats.failed_count) {
+	out_stream << ", " << stats.failed_count << " failed";
+  }
+  out_stream << '\n';
+}
+
+void TestMapRenderer() {
+  {
+	const auto [x, y] = ProjectToWebMercator(Coords{0, 0});
+	ASSERT_EQUAL(x, 128);
+	ASSERT_EQUAL(y, 128);
+  }
+
+  auto make_renderer = [](double prazhskaya_latitude) {
+	MapRenderer renderer;
+	renderer.AddStop("Tolstopaltsevo", Coords{55.611087 * 3.1415926535 / 180,
+		37.20829 * 3.1415926535 / 180});
+	renderer.AddStop("Marushkino", Coords{55.595884 * 3.1415926535 / 180,
+		37.209755 * 3.1415926535 / 180});
+	renderer.AddStop("Rasskazovka", Coords{55.632761 * 3.1415926535 / 180,
+		37.333324 * 3.1415926535 / 180});
+	renderer.AddStop("Prazhskaya", Coords{prazhskaya_latitude * 3.1415926535 / 180,
+		37.603831 * 3.1415926535 / 180});
+	renderer.AddBus("750", {"Tolstopaltsevo", "Marushkino", "Rasskazovka"});
+	return renderer;
+  };
+
+  const filesystem::path dir = filesystem::temp_directory_path() /
+	  ("tiles-test-" + to_string(random_device()()));
+  TileRenderOptions options;
+  options.dir = dir;
+  options.min_zoom = 9;
+  options.max_zoom = 11;
+  options.thread_count = 2;
+
+  const TileRenderStats first = make_renderer(55.611678).RenderTiles(options);
+  ASSERT(first.rendered_count > 0);
+  ASSERT_EQUAL(first.cached_count, 0u);
+  ASSERT_EQUAL(first.removed_count, 0u);
+
+  const TileRenderStats second = make_renderer(55.611678).RenderTiles(options);
+  ASSERT_EQUAL(second.rendered_count, 0u);
+  ASSERT_EQUAL(second.cached_count, first.rendered_count);
+
+  // moving a stop far away touches only the tile it leaves and the one it
+  // enters on each zoom: the first is redrawn, or removed when left empty
+  const TileRenderStats third = make_renderer(10).RenderTiles(options);
+  ASSERT_EQUAL(third.rendered_count + third.removed_count, 6u);
+  ASSERT_EQUAL(third.rendered_count + third.cached_count,
+	  first.rendered_count - third.removed_count + 3);
+  ASSERT(third.cached_count > 0);
+
+  // a tile that cannot be written fails alone and is written on the next run
+  const auto [x, y] = ProjectToWebMercator(Coords{10 * 3.1415926535 / 180,
+	  37.603831 * 3.1415926535 / 180});
+  const filesystem::path blocked = dir / "11" / to_string(int(x * 8)) /
+	  (to_string(int(y * 8)) + ".svg");
+  filesystem::remove(blocked);
+  filesystem::create_directories(blocked / "blocker");
+  const TileRenderStats fourth = make_renderer(10.001).RenderTiles(options);
+  ASSERT_EQUAL(fourth.failed_count, 1u);
+  ASSERT(fourth.rendered_count > 0);
+  filesystem::remove_all(blocked);
+  const TileRenderStats fifth = make_renderer(10.001).RenderTiles(options);
+  ASSERT_EQUAL(fifth.failed_count, 0u);
+  ASSERT_EQUAL(fifth.rendered_count, 1u);
+  ASSERT(filesystem::is_regular_file(blocked));
+
+  const MapRenderer renderer = make_renderer(10);
+  const MapRenderer::ZoomGrid grid = renderer.BuildZoomGrid(0, 0);
+  const string tile = renderer.RenderTile(grid, 0, 0);
+  ASSERT(tile.find("<path") != string::npos);
+  ASSERT(tile.find(">Prazhskaya</text>") != string::npos);
+  ASSERT_EQUAL(renderer.RenderTile(grid, 0, 0), tile);
+  filesystem::remove_all(dir);
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "RouteManager.h"
+
+//---------------------Map Rendering---------------------------//
+
+struct TileRenderOptions {
+  std::filesystem::path dir;
+  int min_zoom = 10;
+  int max_zoom = 14;
+  size_t thread_count = 1;
+};
+
+struct TileRenderStats {
+  size_t rendered_count = 0;
+  size_t cached_count = 0;
+  size_t removed_count = 0;
+  size_t failed_count = 0;
+};
+
+// Draws the network as 256 px SVG tiles in the Web Mercator z/x/y scheme
+// used by web maps. Routes are lines in a color picked by bus name; stops
+// are drawn from max_zoom - 2 and labelled at max_zoom. Only tiles with
+// something on them are written.
+class MapRenderer {
+public:
+  void AddStop(const std::string& stop_name, const Coords& coords);
+
+  // Stops must be added before. A cycle route lists its stops in travel
+  // order; a linear one is drawn along its stops once.
+  void AddBus(const std::string& bus_name, const std::vector<std::string>& stops);
+
+  // Writes dir/z/x/y.svg for every non-empty tile from min_zoom to
+  // max_zoom, one zoom at a time, splitting its tiles between thread_count
+  // tasks. dir/manifest keeps a hash of what each tile shows, so on a
+  // later run only tiles whose stops or routes changed are rendered again,
+  // and tiles left empty are removed. A tile that cannot be written or
+  // removed is counted as failed and tried again on the next run.
+  TileRenderStats RenderTiles(const TileRenderOptions& options) const;
+
+  // What each tile of one zoom shows; built once, then any number of its
+  // tiles is rendered from it.
+  struct ZoomGrid;
+  ZoomGrid BuildZoomGrid(int zoom, int max_zoom) const;
+  std::string RenderTile(const ZoomGrid& grid, uint32_t x, uint32_t y) const;
+
+private:
+  struct Point {
+	double x;
+	double y;
+  };
+
+  struct Stop {
+	std::string name;
+	Point position;
+  };
+
+  struct Bus {
+	std::string name;
+	std::string_view color;
+	std::vector<uint32_t> stops;
+  };
+
+  // segments are (bus, index of the first stop of the segment)
+  struct TileContent {
+	std::vector<std::pair<uint32_t, uint32_t>> segments;
+	std::vector<uint32_t> stops;
+  };
+
+  using TileGrid = std::unordered_map<uint64_t, TileContent>;
+
+  uint64_t HashTile(int zoom, const TileContent& content, int max_zoom) const;
+  std::string RenderTile(int zoom, uint32_t x, uint32_t y, const TileContent& content,
+		  int max_zoom) const;
+
+  std::vector<Stop> stops;
+  std::unordered_map<std::string, uint32_t> stop_ids;
+  std::vector<Bus> buses;
+};
+
+struct MapRenderer::ZoomGrid {
+  int zoom;
+  int max_zoom;
+  TileGrid tiles;
+};
+
+// Position of coords on the Web Mercator world map at zoom 0, in pixels
+// of a 256 px tile.
+std::pair<double, double> ProjectToWebMercator(const Coords& coords);
+
+void PrintTileRenderStats(const TileRenderStats& stats, std::ostream& out_stream);
+
+//---------------------Map Rendering---------------------------//
+
+//---------------------Tests-----------------------------------//
+void TestMapRenderer();
+//---------------------Tests-----------------------------------//
@@ -1,4 +1,5 @@
 #include "Requests.h"
+#include <charconv>
 #include <set>
 
 using namespace std;
@@ -17,6 +18,18 @@ RequestHolder Request::Create(Request::Type type) {
 	  return std::make_unique<ReadBusRequest>();
     case Request::Type::READ_STOP:
     	  return std::make_unique<ReadStopRequest>();
+    case Request::Type::READ_TOP_BUSES:
+      return std::make_unique<ReadTopBusesRequest>();
+    case Request::Type::READ_BUSES_IN_RANGE:
+      return std::make_unique<ReadBusesInRangeRequest>();
+    case Request::Type::READ_BUSY_STOPS:
+      return std::make_unique<ReadBusyStopsRequest>();
+    case Request::Type::READ_LENGTH_HISTOGRAM:
+      return std::make_unique<ReadLengthHistogramRequest>();
+    case Request::Type::READ_REACHABLE:
+      return std::make_unique<ReadReachableRequest>();
+    case Request::Type::READ_REACHABLE_COUNTS:
+      return std::make_unique<ReadReachableCountsRequest>();
     default:
       return nullptr;
   }
@@ -34,6 +47,57 @@ void ReadBusRequest::ParseFrom(std::string_view input) {
   bus_name = input;
 }
 
+ReadTopBusesRequest::ReadTopBusesRequest() : Request(Type::READ_TOP_BUSES) {}
+
+static BusMetric ReadBusMetric(std::string_view& input, std::string& metric_name) {
+  metric_name = ReadToken(input);
+  const auto metric = ConvertBusMetricFromString(metric_name);
+  if (!metric) {
+    throw invalid_argument("unknown metric " + metric_name);
+  }
+  return *metric;
+}
+
+void ReadTopBusesRequest::ParseFrom(std::string_view input) {
+  metric = ReadBusMetric(input, metric_name);
+  count = ConvertToUnsigned(input);
+}
+
+ReadBusesInRangeRequest::ReadBusesInRangeRequest() : Request(Type::READ_BUSES_IN_RANGE) {}
+
+void ReadBusesInRangeRequest::ParseFrom(std::string_view input) {
+  metric = ReadBusMetric(input, metric_name);
+  from = ConvertToDouble(ReadToken(input));
+  to = ConvertToDouble(input);
+}
+
+ReadBusyStopsRequest::ReadBusyStopsRequest() : Request(Type::READ_BUSY_STOPS) {}
+
+void ReadBusyStopsRequest::ParseFrom(std::string_view input) {
+  bus_count = ConvertToUnsigned(input);
+}
+
+ReadLengthHistogramRequest::ReadLengthHistogramRequest()
+  : Request(Type::READ_LENGTH_HISTOGRAM) {}
+
+void ReadLengthHistogramRequest::ParseFrom(std::string_view input) {
+  bucket_width = ConvertToDouble(input);
+}
+
+ReadReachableRequest::ReadReachableRequest() : Request(Type::READ_REACHABLE) {}
+
+void ReadReachableRequest::ParseFrom(std::string_view input) {
+  max_buses = ConvertToUnsigned(ReadToken(input));
+  stop_name = input;
+}
+
+ReadReachableCountsRequest::ReadReachableCountsRequest()
+  : Request(Type::READ_REACHABLE_COUNTS) {}
+
+void ReadReachableCountsRequest::ParseFrom(std::string_view input) {
+  max_buses = ConvertToUnsigned(input);
+}
+
 ModifyBusRequest::ModifyBusRequest() : Request(Type::MODIFY_BUS) {}
 
 void ModifyBusRequest::ParseFrom(std::string_view input) {
@@ -69,6 +133,30 @@ void ReadBusRequest::Accept(const Visitor& v) const {
   v.Visit(*this);
 }
 
+void ReadTopBusesRequest::Accept(const Visitor& v) const {
+  v.Visit(*this);
+}
+
+void ReadBusesInRangeRequest::Accept(const Visitor& v) const {
+  v.Visit(*this);
+}
+
+void ReadBusyStopsRequest::Accept(const Visitor& v) const {
+  v.Visit(*this);
+}
+
+void ReadLengthHistogramRequest::Accept(const Visitor& v) const {
+  v.Visit(*this);
+}
+
+void ReadReachableRequest::Accept(const Visitor& v) const {
+  v.Visit(*this);
+}
+
+void ReadReachableCountsRequest::Accept(const Visitor& v) const {
+  v.Visit(*this);
+}
+
 void ModifyBusRequest::Accept(const Visitor& v) const {
   v.Visit(*this);
 }
@@ -112,7 +200,14 @@ vector<string> FormVector(string_view s, string_view delimiter) {
 double ConvertToDouble(string_view str) {
   // use std::from_chars when available to git rid of string copy
   size_t pos;
-  const double result = stod(string(str), &pos);
+  double result;
+  try {
+    result = stod(string(str), &pos);
+  } catch (const out_of_range&) {
+    throw out_of_range("number " + string(str) + " is out of range");
+  } catch (const invalid_argument&) {
+    throw invalid_argument("string " + string(str) + " is not a number");
+  }
   if (pos != str.length()) {
     std::stringstream error;
     error << "string " << str << " contains " << (str.length() - pos) << " trailing chars";
@@ -121,6 +216,18 @@ double ConvertToDouble(string_view str) {
   return result;
 }
 
+size_t ConvertToUnsigned(string_view str) {
+  size_t result = 0;
+  const auto [end, error] = from_chars(str.data(), str.data() + str.size(), result);
+  if (error == errc::result_out_of_range) {
+	throw out_of_range("number " + string(str) + " is out of range");
+  }
+  if (error != errc() || end != str.data() + str.size()) {
+	throw invalid_argument("string " + string(str) + " is not an unsigned integer");
+  }
+  return result;
+}
+
 template <typename Number>
 Number ReadNumberOnLine(istream& stream) {
   Number number;
@@ -157,13 +264,33 @@ RequestHolder ParseRequest(string_view request_str, bool is_modify) {
   }
   RequestHolder request = Request::Create(*request_type);
   if (request) {
-    request->ParseFrom(request_str);
+    try {
+      request->ParseFrom(request_str);
+    } catch (const exception& e) {
+      request->parse_error = e.what();
+    }
   };
   return request;
 }
 
+bool NeedsStatsIndex(Request::Type type) {
+  return type == Request::Type::READ_TOP_BUSES || type == Request::Type::READ_BUSES_IN_RANGE ||
+	  type == Request::Type::READ_BUSY_STOPS || type == Request::Type::READ_LENGTH_HISTOGRAM;
+}
+
+bool NeedsReachabilityIndex(Request::Type type) {
+  return type == Request::Type::READ_REACHABLE || type == Request::Type::READ_REACHABLE_COUNTS;
+}
+
 vector<RequestHolder> ReadRequests(istream& in_stream, bool is_modify) {
+  size_t line_number = 0;
+  return ReadRequests(in_stream, is_modify, line_number);
+}
+
+vector<RequestHolder> ReadRequests(istream& in_stream, bool is_modify,
+		size_t& line_number) {
   const size_t request_count = ReadNumberOnLine<size_t>(in_stream);
+  ++line_number;
 
   vector<RequestHolder> requests;
   requests.reserve(request_count);
@@ -171,7 +298,9 @@ vector<RequestHolder> ReadRequests(istream& in_stream, bool is_modify) {
   for (size_t i = 0; i < request_count; ++i) {
     string request_str;
     getline(in_stream, request_str);
+    ++line_number;
     if (auto request = ParseRequest(request_str, is_modify)) {
+      request->line_number = line_number;
       requests.push_back(move(request));
     }
   }
@@ -196,7 +325,7 @@ void PrintRouteResponse(const std::string bus_name, optional<BusStats> stats,
   }
 }
 
-void PrintStopResponse(const std::string stop_name, std::optional<std::set<std::string>> stats,
+void PrintStopResponse(const std::string stop_name, const std::set<std::string>* stats,
 		std::ostream& stream) {
   if(!stats) {
     stream << "Stop " << stop_name << ": not found\n";
@@ -213,39 +342,131 @@ void PrintStopResponse(const std::string stop_name, std::optional<std::set<std::
 
 }
 }
+
+void PrintNamesResponse(string_view query, string_view kind,
+		const vector<string_view>& names, ostream& stream) {
+  stream << query << ": ";
+  if(names.empty()) {
+	stream << "no " << kind << '\n';
+	return;
+  }
+  stream << kind;
+  for(string_view name: names) {
+	stream << " " << name;
+  }
+  stream << '\n';
+}
+
+void PrintCountsResponse(string_view query, const vector<string_view>& names,
+		const vector<size_t>& counts, ostream& stream) {
+  stream << query << ":";
+  for(size_t i = 0; i < names.size(); ++i) {
+	stream << (i ? ", " : " ") << names[i] << " " << counts[i];
+  }
+  stream << '\n';
+}
+
+void PrintHistogramResponse(double bucket_width, const optional<vector<size_t>>& histogram,
+		ostream& stream) {
+  stream << "LengthHistogram " << bucket_width << ":";
+  if (!histogram) {
+	stream << " too many buckets\n";
+	return;
+  }
+  for(size_t i = 0; i < histogram->size(); ++i) {
+	stream << (i ? ", [" : " [") << i * bucket_width << ", " << (i + 1) * bucket_width
+		   << ") " << (*histogram)[i];
+  }
+  stream << '\n';
+}
 //-----------------------PrintResults-------------------------------//
 
 
 //---------------Visitor------------------------------//
 
 void Visitor::Visit(const ReadBusRequest& request) const {
-  PrintRouteResponse(request.bus_name, rm->GetBusStats(request.bus_name), cout);
+  PrintRouteResponse(request.bus_name, rm->GetBusStats(request.bus_name), *output);
 }
 
 void Visitor::Visit(const ReadStopRequest& request) const {
-  PrintStopResponse(request.stop_name, rm->GetStopStats(request.stop_name), cout);
+  PrintStopResponse(request.stop_name, rm->GetStopStats(request.stop_name), *output);
 }
 
 void Visitor::Visit(const ModifyBusRequest& request) const {
   if(request.cycle) {
-	rm->SetStrategy(cycle_strategy.get());
+	rm->SetBusData<CycleRoute>(request.bus_name, request.stops);
   } else {
-	rm->SetStrategy(not_cycle_strategy.get());
+	rm->SetBusData<NotCycleRoute>(request.bus_name, request.stops);
   }
-  rm->SetBusData(request.bus_name, request.stops);
 }
 void Visitor::Visit(const ModifyStopRequest& request) const {
   rm->SetStopData(request.stop_name, Coords{request.latitude, request.longitude},
 		  request.distances);
 }
 
+void Visitor::Visit(const ReadTopBusesRequest& request) const {
+  ostringstream query;
+  query << "TopBuses " << request.metric_name << " " << request.count;
+  PrintNamesResponse(query.str(), "buses", stats_index->TopBuses(request.metric, request.count),
+	  *output);
+}
+
+void Visitor::Visit(const ReadBusesInRangeRequest& request) const {
+  ostringstream query;
+  query.precision(output->precision());
+  query << "BusesInRange " << request.metric_name << " " << request.from << " " << request.to;
+  PrintNamesResponse(query.str(), "buses",
+	  stats_index->BusesInRange(request.metric, request.from, request.to), *output);
+}
+
+void Visitor::Visit(const ReadBusyStopsRequest& request) const {
+  ostringstream query;
+  query << "BusyStops " << request.bus_count;
+  PrintNamesResponse(query.str(), "stops", stats_index->StopsServedByMoreThan(request.bus_count),
+	  *output);
+}
+
+void Visitor::Visit(const ReadLengthHistogramRequest& request) const {
+  PrintHistogramResponse(request.bucket_width,
+	  stats_index->LengthHistogram(request.bucket_width), *output);
+}
+
+void Visitor::Visit(const ReadReachableRequest& request) const {
+  ostringstream query;
+  query << "Reachable " << request.max_buses << " " << request.stop_name;
+  const auto stops = reachability_index->ReachableStops(request.stop_name, request.max_buses);
+  if(!stops) {
+	*output << query.str() << ": not found\n";
+	return;
+  }
+  PrintNamesResponse(query.str(), "stops", *stops, *output);
+}
+
+void Visitor::Visit(const ReadReachableCountsRequest& request) const {
+  PrintCountsResponse("ReachableCounts " + to_string(request.max_buses),
+	  reachability_index->GetStopNames(),
+	  reachability_index->CountReachableFromAll(request.max_buses), *output);
+}
+
 void Visitor::SetRouteManager(RouteManager* rm_) {
   rm = rm_;
 }
 
-Visitor::Visitor() {
-  cycle_strategy = make_unique<CycleStrategy>();
-  not_cycle_strategy = make_unique<NotCycleStrategy>();
+void Visitor::SetStatsIndex(const StatsIndex* index_) {
+  stats_index = index_;
+}
+
+void Visitor::SetReachabilityIndex(const ReachabilityIndex* index_) {
+  reachability_index = index_;
+}
+
+void Visitor::SetOutputStream(std::ostream* output_) {
+  output = output_;
+}
+
+bool Visitor::CanVisit(Request::Type type) const {
+  return !(NeedsStatsIndex(type) && !stats_index) &&
+	  !(NeedsReachabilityIndex(type) && !reachability_index);
 }
 
 //---------------Visitor------------------------------//
@@ -8,6 +8,8 @@
 #include <string_view>
 #include <sstream>
 #include "RouteManager.h"
+#include "Analytics.h"
+#include "Reachability.h"
 
 class Visitor;
 class Request;
@@ -19,6 +21,12 @@ public:
   enum class Type {
 	READ_STOP,
     READ_BUS,
+    READ_TOP_BUSES,
+    READ_BUSES_IN_RANGE,
+    READ_BUSY_STOPS,
+    READ_LENGTH_HISTOGRAM,
+    READ_REACHABLE,
+    READ_REACHABLE_COUNTS,
     MODIFY_BUS,
 	MODIFY_STOP,
   };
@@ -29,6 +37,8 @@ public:
   virtual ~Request() = default;
   virtual void Accept(const Visitor& v) const = 0;
   const Type type;
+  size_t line_number = 0;
+  std::optional<std::string> parse_error;
 };
 
 const std::unordered_map<std::string_view, Request::Type> MODIFY_REQUEST_TYPE = {
@@ -39,6 +49,12 @@ const std::unordered_map<std::string_view, Request::Type> MODIFY_REQUEST_TYPE =
 const std::unordered_map<std::string_view, Request::Type> READ_REQUEST_TYPE = {
     {"Bus", Request::Type::READ_BUS},
 	{"Stop", Request::Type::READ_STOP},
+	{"TopBuses", Request::Type::READ_TOP_BUSES},
+	{"BusesInRange", Request::Type::READ_BUSES_IN_RANGE},
+	{"BusyStops", Request::Type::READ_BUSY_STOPS},
+	{"LengthHistogram", Request::Type::READ_LENGTH_HISTOGRAM},
+	{"Reachable", Request::Type::READ_REACHABLE},
+	{"ReachableCounts", Request::Type::READ_REACHABLE_COUNTS},
 };
 
 class ReadStopRequest : public Request {
@@ -59,6 +75,71 @@ public:
   std::string bus_name;
 };
 
+// TopBuses <metric> <k>
+class ReadTopBusesRequest : public Request {
+public:
+  ReadTopBusesRequest();
+  void ParseFrom(std::string_view input) override;
+  void Accept(const Visitor& v) const override;
+
+  std::string metric_name;
+  BusMetric metric;
+  size_t count;
+};
+
+// BusesInRange <metric> <from> <to>
+class ReadBusesInRangeRequest : public Request {
+public:
+  ReadBusesInRangeRequest();
+  void ParseFrom(std::string_view input) override;
+  void Accept(const Visitor& v) const override;
+
+  std::string metric_name;
+  BusMetric metric;
+  double from, to;
+};
+
+// BusyStops <n>: stops served by more than n buses
+class ReadBusyStopsRequest : public Request {
+public:
+  ReadBusyStopsRequest();
+  void ParseFrom(std::string_view input) override;
+  void Accept(const Visitor& v) const override;
+
+  size_t bus_count;
+};
+
+// LengthHistogram <bucket width>
+class ReadLengthHistogramRequest : public Request {
+public:
+  ReadLengthHistogramRequest();
+  void ParseFrom(std::string_view input) override;
+  void Accept(const Visitor& v) const override;
+
+  double bucket_width;
+};
+
+// Reachable <max buses> <stop name>
+class ReadReachableRequest : public Request {
+public:
+  ReadReachableRequest();
+  void ParseFrom(std::string_view input) override;
+  void Accept(const Visitor& v) const override;
+
+  size_t max_buses;
+  std::string stop_name;
+};
+
+// ReachableCounts <max buses>: for every stop, how many others are reachable
+class ReadReachableCountsRequest : public Request {
+public:
+  ReadReachableCountsRequest();
+  void ParseFrom(std::string_view input) override;
+  void Accept(const Visitor& v) const override;
+
+  size_t max_buses;
+};
+
 class ModifyBusRequest : public Request {
 public:
   ModifyBusRequest();
@@ -99,6 +180,9 @@ std::vector<std::string>
 
 double ConvertToDouble(std::string_view str);
 
+// Only digits are accepted, so a sign or a fraction throws too.
+size_t ConvertToUnsigned(std::string_view str);
+
 template <typename Number>
 Number ReadNumberOnLine(std::istream& stream);
 
@@ -109,31 +193,61 @@ RequestHolder ParseRequest(std::string_view request_str, bool is_modify);
 
 std::vector<RequestHolder> ReadRequests(std::istream& in_stream, bool is_modify);
 
+std::vector<RequestHolder> ReadRequests(std::istream& in_stream, bool is_modify,
+		size_t& line_number);
+
+// Read requests answered from a StatsIndex or a ReachabilityIndex, which
+// are only built when such requests are served.
+bool NeedsStatsIndex(Request::Type type);
+bool NeedsReachabilityIndex(Request::Type type);
+
 std::vector<double> ProcessRequests(const std::vector<RequestHolder>& requests);
 
 void PrintRouteResponse(const std::string bus_name, std::optional<BusStats> stats,
 		std::ostream& stream);
 
-void PrintStopResponse(const std::string stop_name, std::optional<std::set<std::string>> stats,
+void PrintStopResponse(const std::string stop_name, const std::set<std::string>* stats,
 		std::ostream& stream);
 
+void PrintNamesResponse(std::string_view query, std::string_view kind,
+		const std::vector<std::string_view>& names, std::ostream& stream);
+
+void PrintHistogramResponse(double bucket_width,
+		const std::optional<std::vector<size_t>>& histogram, std::ostream& stream);
+
+void PrintCountsResponse(std::string_view query, const std::vector<std::string_view>& names,
+		const std::vector<size_t>& counts, std::ostream& stream);
+
 //------------------Parsing Functions-----------------------------//
 
 //-----------------------Visitor--------------------------------//
 
 class Visitor {
 public:
-  Visitor();
   void Visit(const ReadBusRequest&) const;
   void Visit(const ModifyBusRequest&) const;
   void Visit(const ModifyStopRequest&) const;
   void Visit(const ReadStopRequest&) const;
+  void Visit(const ReadTopBusesRequest&) const;
+  void Visit(const ReadBusesInRangeRequest&) const;
+  void Visit(const ReadBusyStopsRequest&) const;
+  void Visit(const ReadLengthHistogramRequest&) const;
+  void Visit(const ReadReachableRequest&) const;
+  void Visit(const ReadReachableCountsRequest&) const;
   void SetRouteManager(RouteManager* rm_);
+  void SetStatsIndex(const StatsIndex* index_);
+  void SetReachabilityIndex(const ReachabilityIndex* index_);
+  void SetOutputStream(std::ostream* output_);
+  // False for read requests whose index was not set.
+  bool CanVisit(Request::Type type) const;
 private:
-  RouteManager* rm;
-  std::unique_ptr<Strategy> cycle_strategy;
-  std::unique_ptr<Strategy> not_cycle_strategy;
+  std::ostream* output = &std::cout;
+  RouteManager* rm = nullptr;
+  const StatsIndex* stats_index = nullptr;
+  const ReachabilityIndex* reachability_index = nullptr;
 };
 
 //-------------------------Tests--------------------------------//
 void TestReadRequest();
+void TestReadAnalyticsRequest();
+void TestReadReachableRequest();
@@ -2,26 +2,133 @@
 #include <sstream>
 #include "test_runner.h"
 #include <iomanip>
+#include <limits>
+#include <random>
+#include <tuple>
 using namespace std;
 
-double Strategy::ComputeDistance(const Coords& lhs, const Coords& rhs) const {
+// A stop repeated on a route is a segment of length exactly 0, whatever
+// rounding the coordinates went through; otherwise the cosine is clamped,
+// as rounding may take it just past 1 for points close to each other.
+double ComputeDistance(const Coords& lhs, const Coords& rhs) {
+  if (lhs.latitude == rhs.latitude && lhs.longitude == rhs.longitude) {
+	return 0;
+  }
+  const long double cosine = sin(lhs.latitude) * sin(rhs.latitude) +
+		  cos(lhs.latitude) * cos(rhs.latitude) *
+		  cos(abs(lhs.longitude - rhs.longitude));
+  return acos(clamp<long double>(cosine, -1, 1)) * 6371000;
+}
 
-  return acos(sin(lhs.latitude) * sin(rhs.latitude) +
-		      cos(lhs.latitude) * cos(rhs.latitude) *
-		      cos(abs(lhs.longitude - rhs.longitude))) *
-		      6371000;
+uint64_t ComputeHilbertIndex(uint32_t x, uint32_t y) {
+  uint64_t index = 0;
+  for (uint64_t s = uint64_t(1) << 31; s > 0; s /= 2) {
+	const uint64_t rx = (x & s) > 0;
+	const uint64_t ry = (y & s) > 0;
+	index += s * s * ((3 * rx) ^ ry);
+	if (ry == 0) {
+	  if (rx == 1) {
+		x = ~x;
+		y = ~y;
+	  }
+	  swap(x, y);
+	}
+  }
+  return index;
 }
 
-int Strategy::ComputeUniqueStopsOnRoute(const std::vector<std::string>& stops) const {
-  std::set<std::string> s(begin(stops), end(stops));
-  return s.size();
+FixedCoords QuantizeCoords(const Coords& coords) {
+  auto quantize = [](long double radians) {
+	return static_cast<int32_t>(clamp<long long>(llroundl(radians / FIXED_COORDS_STEP),
+		numeric_limits<int32_t>::min(), numeric_limits<int32_t>::max()));
+  };
+  return {quantize(coords.latitude), quantize(coords.longitude)};
+}
+
+void StopLayout::Build(unordered_map<string, StopDataBase>& stop_db, bool compact_) {
+  long double min_latitude = 0, max_latitude = 0, min_longitude = 0, max_longitude = 0;
+  bool first = true;
+  for (const auto& [stop_name, stop]: stop_db) {
+	const Coords c = stop.GetCoords();
+	if (first || c.latitude < min_latitude) min_latitude = c.latitude;
+	if (first || c.latitude > max_latitude) max_latitude = c.latitude;
+	if (first || c.longitude < min_longitude) min_longitude = c.longitude;
+	if (first || c.longitude > max_longitude) max_longitude = c.longitude;
+	first = false;
+  }
+  auto quantize = [](long double value, long double min_value, long double max_value) {
+	return max_value > min_value ? static_cast<uint32_t>((value - min_value) /
+		(max_value - min_value) * numeric_limits<uint32_t>::max()) : 0u;
+  };
+
+  // ties are broken by name, so the layout does not depend on hashing
+  vector<tuple<uint64_t, string_view, StopDataBase*>> order;
+  order.reserve(stop_db.size());
+  for (auto& [stop_name, stop]: stop_db) {
+	const Coords c = stop.GetCoords();
+	order.emplace_back(ComputeHilbertIndex(
+		quantize(c.longitude, min_longitude, max_longitude),
+		quantize(c.latitude, min_latitude, max_latitude)), stop_name, &stop);
+  }
+  sort(begin(order), end(order));
+
+  compact = compact_;
+  stops.clear();
+  coords.clear();
+  fixed_coords.clear();
+  vector<pair<string_view, uint32_t>> entries;
+  entries.reserve(order.size());
+  for (const auto& [hilbert_index, stop_name, stop]: order) {
+	entries.push_back({stop_name, static_cast<uint32_t>(stops.size())});
+	stops.push_back(stop);
+	if (compact) {
+	  fixed_coords.push_back(QuantizeCoords(stop->GetCoords()));
+	} else {
+	  coords.push_back(stop->GetCoords());
+	}
+  }
+  ids.Build(entries);
+  route_epochs.assign(stops.size(), 0);
+
+  distance_offsets.assign(1, 0);
+  distance_targets.clear();
+  distance_values.clear();
+  compact_distance_values.clear();
+  vector<pair<uint32_t, double>> row;
+  for (const StopDataBase* stop: stops) {
+	row.clear();
+	for (const auto& [stop_name, distance]: stop->GetDistance()) {
+	  row.push_back({GetId(stop_name), distance});
+	}
+	sort(begin(row), end(row));
+	for (const auto& [target, distance]: row) {
+	  distance_targets.push_back(target);
+	  distance_values.push_back(distance);
+	}
+	distance_offsets.push_back(distance_targets.size());
+  }
+
+  compact_distances = compact && all_of(begin(distance_values), end(distance_values),
+	  [](double distance) {
+	const double scaled = distance * DISTANCE_SCALE;
+	return scaled >= 0 && scaled <= numeric_limits<uint32_t>::max() &&
+		static_cast<uint32_t>(scaled) / DISTANCE_SCALE == distance;
+  });
+  if (compact_distances) {
+	compact_distance_values.reserve(distance_values.size());
+	for (double distance: distance_values) {
+	  compact_distance_values.push_back(distance * DISTANCE_SCALE);
+	}
+	distance_values.clear();
+	distance_values.shrink_to_fit();
+  }
+  built = true;
 }
 
 void TestComputeDistance() {
   ostringstream os;
   os.precision(6);
-  CycleStrategy strategy;
-  os << strategy.ComputeDistance(Coords{55.611087 * 3.1415926535 / 180,
+  os << ComputeDistance(Coords{55.611087 * 3.1415926535 / 180,
 		37.20829 * 3.1415926535 / 180}, Coords{55.595884 * 3.1415926535 / 180,
 		37.209755 * 3.1415926535 / 180});
 
@@ -35,7 +142,6 @@ void TestBusStats() {
 
 	  //--------Not cycle--------------------//
 
-	  unique_ptr<Strategy> not_cycle = make_unique<NotCycleStrategy>();
 	  manager.SetStopData("Tolstopaltsevo", Coords{55.611087 * 3.1415926535 / 180,
 			37.20829 * 3.1415926535 / 180}, vector<DistanceToStop>({{3900, "Marushkino"}}));
 	  manager.SetStopData("Marushkino", Coords{55.595884 * 3.1415926535 / 180,
@@ -44,9 +150,7 @@ void TestBusStats() {
 			37.333324 * 3.1415926535 / 180}, {});
 	  manager.SetStopData("Extra stop", Coords{53.632761 * 3.1415926535 / 180,
 			37.333324 * 3.1415926535 / 180}, {});
-
-	  manager.SetStrategy(not_cycle.get());
-	  manager.SetBusData("750", stops);
+	  manager.SetBusData<NotCycleRoute>("750", stops);
 	  BusStats stats = *manager.GetBusStats("750");
 	  ASSERT_EQUAL(stats.stop_count, 5);
 	  ASSERT_EQUAL(stats.unique_stop_count, 3);
@@ -70,7 +174,6 @@ void TestBusStats() {
 
 	  //--------Cycle--------------------//
 
-	  unique_ptr<Strategy> cycle = make_unique<CycleStrategy>();
 	  manager.SetStopData("Biryulyovo Zapadnoye", Coords{55.574371 * 3.1415926535 / 180,
 			37.6517 * 3.1415926535 / 180}, vector<DistanceToStop>({{7500, "Rossoshanskaya ulitsa"},
 				{1800, "Biryusinka"}, {2400, "Universam"}}));
@@ -83,9 +186,7 @@ void TestBusStats() {
 			37.653656 * 3.1415926535 / 180}, vector<DistanceToStop>({{1300, "Biryulyovo Passazhirskaya"}}));
 	  manager.SetStopData("Biryulyovo Passazhirskaya", Coords{55.580999 * 3.1415926535 / 180,
 			37.659164 * 3.1415926535 / 180}, vector<DistanceToStop>({{1200, "Biryulyovo Zapadnoye"}}));
-
-	  manager.SetStrategy(cycle.get());
-	  manager.SetBusData("256", stops);
+	  manager.SetBusData<CycleRoute>("256", stops);
 	  BusStats stats = *manager.GetBusStats("256");
 	  ASSERT_EQUAL(stats.stop_count, 6);
 	  ASSERT_EQUAL(stats.unique_stop_count, 5);
@@ -113,7 +214,6 @@ void TestStopStats() {
 
     //--------Not cycle--------------------//
 
-    unique_ptr<Strategy> not_cycle = make_unique<NotCycleStrategy>();
     manager.SetStopData("Tolstopaltsevo", Coords{55.611087 * 3.1415926535 / 180,
 		37.20829 * 3.1415926535 / 180}, vector<DistanceToStop>({{3900, "Marushkino"}}));
     manager.SetStopData("Marushkino", Coords{55.595884 * 3.1415926535 / 180,
@@ -122,11 +222,229 @@ void TestStopStats() {
 		37.333324 * 3.1415926535 / 180}, {});
     manager.SetStopData("Extra stop", Coords{53.632761 * 3.1415926535 / 180,
 		37.333324 * 3.1415926535 / 180}, {});
-    manager.SetStrategy(not_cycle.get());
-    manager.SetBusData("750", stops);
+    manager.SetBusData<NotCycleRoute>("750", stops);
     ASSERT(manager.GetStopStats("Extra stop")->empty());
     ASSERT(!manager.GetStopStats("250"));
     ASSERT_EQUAL(*manager.GetStopStats("Tolstopaltsevo"), set<string>({{"750"}}));
   }
+  {
+
+    //--------Cycle--------------------//
+
+    manager.SetBusData<CycleRoute>("828", {"Tolstopaltsevo", "Marushkino", "Tolstopaltsevo"});
+    ASSERT_EQUAL(manager.GetBusStats("828")->unique_stop_count, 2);
+    ASSERT_EQUAL(*manager.GetStopStats("Tolstopaltsevo"), set<string>({"750", "828"}));
+    ASSERT_EQUAL(*manager.GetStopStats("Rasskazovka"), set<string>({"750"}));
+  }
+}
+
+void TestLookupIndex() {
+  RouteManager manager;
+  manager.SetStopData("Tolstopaltsevo", Coords{55.611087 * 3.1415926535 / 180,
+		37.20829 * 3.1415926535 / 180}, vector<DistanceToStop>({{3900, "Marushkino"}}));
+  manager.SetStopData("Marushkino", Coords{55.595884 * 3.1415926535 / 180,
+		37.209755 * 3.1415926535 / 180}, {});
+  manager.SetBusData<NotCycleRoute>("750", {"Tolstopaltsevo", "Marushkino"});
+  manager.BuildLookupIndex();
+
+  const string_view line = "Bus 750";
+  ASSERT_EQUAL(manager.GetBusStats(line.substr(4))->stop_count, 3);
+  ASSERT(!manager.GetBusStats("75"));
+  ASSERT_EQUAL(*manager.GetStopStats("Marushkino"), set<string>({"750"}));
+  ASSERT(!manager.GetStopStats("Samara"));
+
+  // modifications after the build are visible right away
+  manager.SetStopData("Samara", Coords{53.2 * 3.1415926535 / 180,
+		50.1 * 3.1415926535 / 180}, {});
+  ASSERT(manager.GetStopStats("Samara")->empty());
+}
+
+void TestStopLayout() {
+  {
+	// consecutive cells of the curve are neighbours on the grid
+	vector<pair<uint64_t, pair<uint32_t, uint32_t>>> cells;
+	for (uint32_t x = 0; x < 4; ++x) {
+	  for (uint32_t y = 0; y < 4; ++y) {
+		cells.push_back({ComputeHilbertIndex(x, y), {x, y}});
+	  }
+	}
+	sort(begin(cells), end(cells));
+	for (size_t i = 0; i < cells.size(); ++i) {
+	  ASSERT_EQUAL(cells[i].first, i);
+	  if (i > 0) {
+		const auto [x1, y1] = cells[i - 1].second;
+		const auto [x2, y2] = cells[i].second;
+		ASSERT_EQUAL(max(x1, x2) - min(x1, x2) + max(y1, y2) - min(y1, y2), 1u);
+	  }
+	}
+  }
+
+  RouteManager plain, laid_out;
+  for (RouteManager* manager: {&plain, &laid_out}) {
+	manager->SetStopData("Biryulyovo Zapadnoye", Coords{55.574371 * 3.1415926535 / 180,
+		  37.6517 * 3.1415926535 / 180}, vector<DistanceToStop>({{1800, "Biryusinka"},
+			  {2400, "Universam"}}));
+	manager->SetStopData("Biryusinka", Coords{55.581065 * 3.1415926535 / 180,
+		  37.64839 * 3.1415926535 / 180}, vector<DistanceToStop>({{750, "Universam"}}));
+	manager->SetStopData("Universam", Coords{55.587655 * 3.1415926535 / 180,
+		  37.645687 * 3.1415926535 / 180}, vector<DistanceToStop>({{900, "Biryulyovo Tovarnaya"}}));
+	manager->SetStopData("Biryulyovo Tovarnaya", Coords{55.592028 * 3.1415926535 / 180,
+		  37.653656 * 3.1415926535 / 180}, vector<DistanceToStop>({{1300, "Biryulyovo Passazhirskaya"}}));
+	manager->SetStopData("Biryulyovo Passazhirskaya", Coords{55.580999 * 3.1415926535 / 180,
+		  37.659164 * 3.1415926535 / 180}, vector<DistanceToStop>({{1200, "Biryulyovo Zapadnoye"}}));
+  }
+  laid_out.BuildStopLayout();
+  ASSERT(laid_out.GetStopLayout().IsBuilt());
+  ASSERT(!laid_out.GetStopLayout().FindId("Samara"));
+  for (RouteManager* manager: {&plain, &laid_out}) {
+	manager->SetBusData<CycleRoute>("256", {"Biryulyovo Zapadnoye", "Biryusinka", "Universam",
+		"Biryulyovo Tovarnaya", "Biryulyovo Passazhirskaya", "Biryulyovo Zapadnoye"});
+	manager->SetBusData<NotCycleRoute>("297", {"Biryulyovo Zapadnoye", "Universam",
+		"Biryulyovo Tovarnaya"});
+  }
+  for (const string bus_name: {"256", "297"}) {
+	const BusStats expected = *plain.GetBusStats(bus_name);
+	const BusStats stats = *laid_out.GetBusStats(bus_name);
+	ASSERT_EQUAL(stats.stop_count, expected.stop_count);
+	ASSERT_EQUAL(stats.unique_stop_count, expected.unique_stop_count);
+	ASSERT_EQUAL(stats.route_distance, expected.route_distance);
+	ASSERT_EQUAL(stats.curvature, expected.curvature);
+  }
+  ASSERT_EQUAL(*laid_out.GetStopStats("Universam"), set<string>({"256", "297"}));
+
+  laid_out.SetStopData("Samara", Coords{53.2 * 3.1415926535 / 180, 50.1 * 3.1415926535 / 180}, {});
+  ASSERT(!laid_out.GetStopLayout().IsBuilt());
 }
 
+void TestCompactStopLayout() {
+  {
+	const Coords coords{55.611087 * 3.1415926535 / 180, -37.2082953 * 3.1415926535 / 180};
+	const FixedCoords fixed = QuantizeCoords(coords);
+	ASSERT_EQUAL(fixed.latitude, 556110870);
+	ASSERT_EQUAL(fixed.longitude, -372082953);
+	ASSERT(abs(DequantizeCoords(fixed).latitude - coords.latitude) < 1e-15);
+	ASSERT(abs(DequantizeCoords(fixed).longitude - coords.longitude) < 1e-15);
+  }
+
+  auto print_stats = [](const BusStats& stats) {
+	ostringstream os;
+	os.precision(6);
+	os << stats.stop_count << ' ' << stats.unique_stop_count << ' ' << stats.route_distance
+	   << ' ' << stats.curvature;
+	return os.str();
+  };
+
+  // the README example
+  for (bool compact: {false, true}) {
+	RouteManager manager;
+	manager.SetStopData("Tolstopaltsevo", Coords{55.611087 * 3.1415926535 / 180,
+		37.20829 * 3.1415926535 / 180}, {{3900, "Marushkino"}});
+	manager.SetStopData("Marushkino", Coords{55.595884 * 3.1415926535 / 180,
+		37.209755 * 3.1415926535 / 180}, {{9900, "Rasskazovka"}});
+	manager.SetStopData("Rasskazovka", Coords{55.632761 * 3.1415926535 / 180,
+		37.333324 * 3.1415926535 / 180}, {});
+	manager.SetStopData("Biryulyovo Zapadnoye", Coords{55.574371 * 3.1415926535 / 180,
+		37.6517 * 3.1415926535 / 180}, {{7500, "Rossoshanskaya ulitsa"},
+		{1800, "Biryusinka"}, {2400, "Universam"}});
+	manager.SetStopData("Biryusinka", Coords{55.581065 * 3.1415926535 / 180,
+		37.64839 * 3.1415926535 / 180}, {{750, "Universam"}});
+	manager.SetStopData("Universam", Coords{55.587655 * 3.1415926535 / 180,
+		37.645687 * 3.1415926535 / 180}, {{5600, "Rossoshanskaya ulitsa"},
+		{900, "Biryulyovo Tovarnaya"}});
+	manager.SetStopData("Biryulyovo Tovarnaya", Coords{55.592028 * 3.1415926535 / 180,
+		37.653656 * 3.1415926535 / 180}, {{1300, "Biryulyovo Passazhirskaya"}});
+	manager.SetStopData("Biryulyovo Passazhirskaya", Coords{55.580999 * 3.1415926535 / 180,
+		37.659164 * 3.1415926535 / 180}, {{1200, "Biryulyovo Zapadnoye"}});
+	manager.SetStopData("Rossoshanskaya ulitsa", Coords{55.595579 * 3.1415926535 / 180,
+		37.605757 * 3.1415926535 / 180}, {});
+	manager.BuildStopLayout(compact);
+	ASSERT_EQUAL(manager.GetStopLayout().IsCompact(), compact);
+	manager.SetBusData<CycleRoute>("256", {"Biryulyovo Zapadnoye", "Biryusinka", "Universam",
+		"Biryulyovo Tovarnaya", "Biryulyovo Passazhirskaya", "Biryulyovo Zapadnoye"});
+	manager.SetBusData<NotCycleRoute>("750", {"Tolstopaltsevo", "Marushkino", "Rasskazovka"});
+	manager.SetBusData<CycleRoute>("828", {"Biryulyovo Zapadnoye", "Universam",
+		"Rossoshanskaya ulitsa", "Biryulyovo Zapadnoye"});
+	ASSERT_EQUAL(print_stats(*manager.GetBusStats("256")), "6 5 5950 1.36124");
+	ASSERT_EQUAL(print_stats(*manager.GetBusStats("750")), "5 3 27600 1.31808");
+	ASSERT_EQUAL(print_stats(*manager.GetBusStats("828")), "4 3 15500 1.95908");
+  }
+
+  // fractional distances, on the millimetre grid and off it
+  for (double distance: {1000.9, 1000.0005}) {
+	RouteManager plain, compact;
+	for (RouteManager* manager: {&plain, &compact}) {
+	  manager->SetStopData("A", Coords{55.6 * 3.1415926535 / 180, 37.2 * 3.1415926535 / 180},
+		  {{distance, "B"}});
+	  manager->SetStopData("B", Coords{55.605 * 3.1415926535 / 180, 37.2 * 3.1415926535 / 180},
+		  {});
+	}
+	compact.BuildStopLayout(true);
+	plain.SetBusData<NotCycleRoute>("1", {"A", "B"});
+	compact.SetBusData<NotCycleRoute>("1", {"A", "B"});
+	ASSERT_EQUAL(print_stats(*compact.GetBusStats("1")), print_stats(*plain.GetBusStats("1")));
+  }
+
+  // a route through one stop repeated has zero length on both paths
+  {
+	RouteManager plain, compact;
+	for (RouteManager* manager: {&plain, &compact}) {
+	  manager->SetStopData("X", Coords{55.611087 * 3.1415926535 / 180,
+		  37.20829 * 3.1415926535 / 180}, {{500, "X"}});
+	}
+	compact.BuildStopLayout(true);
+	plain.SetBusData<NotCycleRoute>("1", {"X", "X"});
+	compact.SetBusData<NotCycleRoute>("1", {"X", "X"});
+	ASSERT_EQUAL(print_stats(*plain.GetBusStats("1")), "3 1 1000 inf");
+	ASSERT_EQUAL(print_stats(*compact.GetBusStats("1")), print_stats(*plain.GetBusStats("1")));
+  }
+
+  // a network of short hops with 6 and 7 decimal coordinates, where
+  // rounding would show first
+  mt19937 generator(36);
+  const size_t stops_count = 500;
+  vector<string> stop_names;
+  vector<Coords> stop_coords;
+  for (size_t i = 0; i < stops_count; ++i) {
+	const int decimals_scale = i % 2 ? 10000000 : 1000000;
+	const double latitude = 55.5 + double(generator() % 20000) / decimals_scale;
+	const double longitude = 37.4 + double(generator() % 20000) / decimals_scale;
+	stop_names.push_back("S" + to_string(i));
+	stop_coords.push_back({latitude * 3.1415926535 / 180, longitude * 3.1415926535 / 180});
+  }
+  vector<vector<string>> routes;
+  vector<vector<DistanceToStop>> distances(stops_count);
+  for (size_t i = 0; i < 300; ++i) {
+	vector<string> route;
+	size_t stop = generator() % stops_count;
+	route.push_back(stop_names[stop]);
+	for (size_t length = 2 + generator() % 30; route.size() < length;) {
+	  const size_t next = generator() % stops_count;
+	  if (next == stop) {
+		continue;
+	  }
+	  const double geo_distance = ComputeDistance(stop_coords[stop], stop_coords[next]);
+	  distances[stop].emplace_back(ceil(geo_distance) + generator() % 1000, stop_names[next]);
+	  route.push_back(stop_names[next]);
+	  stop = next;
+	}
+	routes.push_back(move(route));
+  }
+  RouteManager plain, compact;
+  for (size_t i = 0; i < stops_count; ++i) {
+	plain.SetStopData(stop_names[i], stop_coords[i], distances[i]);
+	compact.SetStopData(stop_names[i], stop_coords[i], distances[i]);
+  }
+  compact.BuildStopLayout(true);
+  for (size_t i = 0; i < routes.size(); ++i) {
+	const string bus_name = to_string(i);
+	if (i % 2) {
+	  plain.SetBusData<CycleRoute>(bus_name, routes[i]);
+	  compact.SetBusData<CycleRoute>(bus_name, routes[i]);
+	} else {
+	  plain.SetBusData<NotCycleRoute>(bus_name, routes[i]);
+	  compact.SetBusData<NotCycleRoute>(bus_name, routes[i]);
+	}
+	ASSERT_EQUAL(print_stats(*compact.GetBusStats(bus_name)),
+		print_stats(*plain.GetBusStats(bus_name)));
+  }
+}
@@ -7,6 +7,10 @@
 #include <set>
 #include <cmath>
 #include <optional>
+#include <string_view>
+#include <algorithm>
+#include <cstdint>
+#include "FlatIndex.h"
 
 struct BusStats {
   int stop_count;
@@ -53,73 +57,160 @@ public:
   const std::unordered_map<std::string, double>& GetDistance() const {
 	return distance;
   }
+
+  // Returns true only on the first call with a given epoch, so a stop
+  // repeated on a route is counted as unique once. Epochs are 64-bit so
+  // the counter never wraps onto a stale stamp.
+  bool MarkOnRoute(uint64_t epoch) {
+	if(route_epoch == epoch) {
+	  return false;
+	}
+	route_epoch = epoch;
+	return true;
+  }
 private:
   Coords coords;
+  uint64_t route_epoch = 0;
   std::set<std::string> buses;
   std::unordered_map<std::string, double> distance;
 };
 
-//---------------------Pattern Strategy-----------------------//
-class Strategy {
+//---------------------Stop Layout-----------------------------//
+// Position of cell (x, y) along a Hilbert curve over a 2^32 x 2^32 grid.
+uint64_t ComputeHilbertIndex(uint32_t x, uint32_t y);
+
+// Coordinates on a grid of 1e-7 degree, about 1 cm, in a quarter of the
+// space of Coords. Coordinates given with up to 7 decimals lie on the
+// grid, so they come back as they were read, up to double rounding.
+struct FixedCoords {
+  int32_t latitude;
+  int32_t longitude;
+};
+
+constexpr long double FIXED_COORDS_STEP = 3.1415926535L / 180 * 1e-7L;
+
+FixedCoords QuantizeCoords(const Coords& coords);
+
+inline Coords DequantizeCoords(const FixedCoords& coords) {
+  return {coords.latitude * FIXED_COORDS_STEP, coords.longitude * FIXED_COORDS_STEP};
+}
+
+// Dense copy of what route traversal reads from the stops, numbered along
+// a Hilbert curve over their coordinates: stops near each other on the
+// map, and so mostly near each other on routes, get near ids. Distances
+// of each stop are one row of a flat array sorted by neighbour id.
+// A compact layout keeps FixedCoords and road distances as whole
+// millimetres in uint32_t: 8 instead of 32 bytes of coordinates a stop and
+// 4 instead of 8 bytes a distance. Distances off the millimetre grid are
+// kept as double, so route lengths never change.
+class StopLayout {
 public:
-  virtual ~Strategy() = default;
-  virtual int ComputeStopsOnRoute(const std::vector<std::string>& stops) const = 0;
+  void Build(std::unordered_map<std::string, StopDataBase>& stop_db, bool compact = false);
 
-  virtual std::pair<int, double> ComputeDistancesOnRoute(const std::vector<std::string>& stops,
-		  const std::unordered_map<std::string, StopDataBase>& stop_db) const  = 0;
+  void Clear() {
+	built = false;
+  }
 
-  double ComputeDistance(const Coords& lhs, const Coords& rhs) const;
+  bool IsBuilt() const {
+	return built;
+  }
 
-  int ComputeUniqueStopsOnRoute(const std::vector<std::string>& stops) const;
+  std::optional<uint32_t> FindId(std::string_view stop_name) const {
+	const uint32_t* id = ids.Find(stop_name);
+	return id ? std::optional<uint32_t>(*id) : std::nullopt;
+  }
 
-  void FillBusesInStopDB(const std::vector<std::string>& stops,
-		  const std:: string& bus_name,
-		  std::unordered_map<std::string, StopDataBase>& stop_db) {
-	for(const std::string& stop_name: stops) {
-	  stop_db[stop_name].GetBuses().insert(bus_name);
+  uint32_t GetId(std::string_view stop_name) const {
+	return *ids.Find(stop_name);
+  }
+
+  StopDataBase& GetStop(uint32_t id) {
+	return *stops[id];
+  }
+
+  bool IsCompact() const {
+	return compact;
+  }
+
+  Coords GetCoords(uint32_t id) const {
+	return compact ? DequantizeCoords(fixed_coords[id]) : coords[id];
+  }
+
+  double GetDistance(uint32_t from, uint32_t to) const {
+	const auto first = distance_targets.begin() + distance_offsets[from];
+	const auto last = distance_targets.begin() + distance_offsets[from + 1];
+	const size_t i = std::lower_bound(first, last, to) - distance_targets.begin();
+	return compact_distances ? compact_distance_values[i] / DISTANCE_SCALE : distance_values[i];
+  }
+
+  bool MarkOnRoute(uint32_t id, uint64_t epoch) {
+	if(route_epochs[id] == epoch) {
+	  return false;
 	}
+	route_epochs[id] = epoch;
+	return true;
   }
+
+private:
+  static constexpr double DISTANCE_SCALE = 1000;
+
+  bool built = false;
+  bool compact = false;
+  bool compact_distances = false;
+  FlatNameIndex<uint32_t> ids;
+  std::vector<StopDataBase*> stops;
+  std::vector<Coords> coords;
+  std::vector<FixedCoords> fixed_coords;
+  std::vector<uint64_t> route_epochs;
+  std::vector<uint32_t> distance_offsets;
+  std::vector<uint32_t> distance_targets;
+  std::vector<double> distance_values;
+  std::vector<uint32_t> compact_distance_values;
 };
+//---------------------Stop Layout-----------------------------//
 
-class CycleStrategy : public Strategy {
-public:
-  int ComputeStopsOnRoute(const std::vector<std::string>& stops) const override {
-    return stops.size();
+//---------------------Route Kinds-----------------------------//
+double ComputeDistance(const Coords& lhs, const Coords& rhs);
+
+// Route kinds are compile-time policies of RouteManager::SetBusData:
+// the whole route is traversed once and every statistic is gathered
+// in that single pass. Input is checked by ValidateModifyRequests
+// beforehand, so the lookups here are not bounds-checked.
+struct CycleRoute {
+  static constexpr double GEO_FACTOR = 1;
+
+  static int ComputeStopsOnRoute(size_t stops_count) {
+    return stops_count;
+  }
+
+  static double ComputeRoadDistance(const StopDataBase& from, const StopDataBase&,
+		  const std::string& to_name, const std::string&) {
+	return from.GetDistance().find(to_name)->second;
   }
 
-  std::pair<int, double> ComputeDistancesOnRoute(const std::vector<std::string>& stops,
-		  const std::unordered_map<std::string, StopDataBase>& stop_db) const override {
-    double sum = 0;
-    int real_sum = 0;
-	for(auto it = begin(stops); it != prev(end(stops)); ++it) {
-	  sum += ComputeDistance(stop_db.at(*it).GetCoords(),
-			  stop_db.at(*next(it)).GetCoords());
-      real_sum += stop_db.at(*it).GetDistance().at(*next(it));
-    }
-	return {real_sum, sum};
+  static double ComputeRoadDistance(const StopLayout& layout, uint32_t from, uint32_t to) {
+	return layout.GetDistance(from, to);
   }
 };
 
-class NotCycleStrategy : public Strategy {
-public:
-  int ComputeStopsOnRoute(const std::vector<std::string>& stops) const override {
-    return stops.size() * 2 - 1;
+struct NotCycleRoute {
+  static constexpr double GEO_FACTOR = 2;
+
+  static int ComputeStopsOnRoute(size_t stops_count) {
+    return stops_count * 2 - 1;
   }
 
-  std::pair<int, double> ComputeDistancesOnRoute(const std::vector<std::string>& stops,
-		  const std::unordered_map<std::string, StopDataBase>& stop_db) const override {
-	double sum = 0;
-	int real_sum = 0;
-	for(auto it = begin(stops); it != prev(end(stops)); ++it) {
-	  sum += 2 * ComputeDistance(stop_db.at(*it).GetCoords(),
-			  stop_db.at(*next(it)).GetCoords());
-	  real_sum += (stop_db.at(*it).GetDistance().at(*next(it)) +
-	      		  stop_db.at(*next(it)).GetDistance().at(*it));
-	}
-	return {real_sum, sum};
+  static double ComputeRoadDistance(const StopDataBase& from, const StopDataBase& to,
+		  const std::string& to_name, const std::string& from_name) {
+	return from.GetDistance().find(to_name)->second +
+			to.GetDistance().find(from_name)->second;
+  }
+
+  static double ComputeRoadDistance(const StopLayout& layout, uint32_t from, uint32_t to) {
+	return layout.GetDistance(from, to) + layout.GetDistance(to, from);
   }
 };
-//---------------------Pattern Strategy-----------------------//
+//---------------------Route Kinds-----------------------------//
 
 
 //---------------------Business Logic of Programm----------------//
@@ -127,6 +218,8 @@ class RouteManager {
 public:
   void SetStopData(const std::string& stop_name, Coords coords,
 		  const std::vector<DistanceToStop>& distances) {
+	lookup_index_built = false;
+	stop_layout.Clear();
 	stop_db[stop_name].SetCoords(coords);
 	for(const DistanceToStop& dist: distances) {
 	  stop_db[stop_name].GetDistance()[dist.stop_name] = dist.distance;
@@ -136,41 +229,156 @@ public:
 	}
   }
 
+  template <typename RouteKind>
   void SetBusData(const std::string& bus_name, const std::vector<std::string>& stops) {
-	BusStats stats;
-	stats.stop_count = strategy->ComputeStopsOnRoute(stops);
-	stats.unique_stop_count = strategy->ComputeUniqueStopsOnRoute(stops);
-	auto [real_route_distance, route_distance] =
-			strategy->ComputeDistancesOnRoute(stops, stop_db);
-	stats.curvature = real_route_distance / route_distance;
-	stats.route_distance = real_route_distance;
-    bus_stats[bus_name] = stats;
-    strategy->FillBusesInStopDB(stops, bus_name, stop_db);
+	lookup_index_built = false;
+	bus_stats[bus_name] = stop_layout.IsBuilt() ?
+			TraverseRoute<RouteKind>(bus_name, stops, LaidOutStops{stop_layout}) :
+			TraverseRoute<RouteKind>(bus_name, stops, NamedStops{stop_db});
   }
 
-  void SetStrategy(Strategy* strategy_) {
-	strategy = strategy_;
+  // Renumbers the stops for traversal of the routes added afterwards;
+  // any later stop modification drops the layout. A compact layout keeps
+  // road distances as whole millimetres, or as double when some are off
+  // that grid, so route lengths stay exact.
+  void BuildStopLayout(bool compact = false) {
+	stop_layout.Build(stop_db, compact);
   }
 
-  std::optional<BusStats> GetBusStats(const std::string& bus_name) const {
-	if(bus_stats.count(bus_name)) {
-	  return bus_stats.at(bus_name);
+  const StopLayout& GetStopLayout() const {
+	return stop_layout;
+  }
+
+  // Builds the read path indexes; any later modification drops them
+  // until the next call.
+  void BuildLookupIndex() {
+	std::vector<std::pair<std::string_view, const BusStats*>> buses;
+	buses.reserve(bus_stats.size());
+	for(const auto& [bus_name, stats]: bus_stats) {
+	  buses.push_back({bus_name, &stats});
+	}
+	bus_index.Build(buses);
+	std::vector<std::pair<std::string_view, const StopDataBase*>> stops;
+	stops.reserve(stop_db.size());
+	for(const auto& [stop_name, stop]: stop_db) {
+	  stops.push_back({stop_name, &stop});
 	}
-	return std::nullopt;
+	stop_index.Build(stops);
+	lookup_index_built = true;
   }
 
-  std::optional<std::set<std::string>> GetStopStats(const std::string& stop_name) {
-	if(stop_db.count(stop_name)) {
-	  return stop_db[stop_name].GetBuses();
+  std::optional<BusStats> GetBusStats(std::string_view bus_name) const {
+	if(lookup_index_built) {
+	  const BusStats* const* stats = bus_index.Find(bus_name);
+	  return stats ? std::optional<BusStats>(**stats) : std::nullopt;
 	}
-	return std::nullopt;
+	const auto it = bus_stats.find(std::string(bus_name));
+	return it != bus_stats.end() ? std::optional<BusStats>(it->second) : std::nullopt;
+  }
+
+  const std::set<std::string>* GetStopStats(std::string_view stop_name) const {
+	if(lookup_index_built) {
+	  const StopDataBase* const* stop = stop_index.Find(stop_name);
+	  return stop ? &(*stop)->GetBuses() : nullptr;
+	}
+	const auto it = stop_db.find(std::string(stop_name));
+	return it != stop_db.end() ? &it->second.GetBuses() : nullptr;
+  }
 
+  const std::unordered_map<std::string, BusStats>& GetAllBusStats() const {
+	return bus_stats;
+  }
+
+  const std::unordered_map<std::string, StopDataBase>& GetStopDataBase() const {
+	return stop_db;
   }
 
 private:
+  // Stop access for TraverseRoute by name in stop_db; a handle is the
+  // stop with the name it was looked up by.
+  struct NamedStops {
+	using Handle = std::pair<StopDataBase*, const std::string*>;
+
+	Handle Find(const std::string& stop_name) const {
+	  return {&stop_db.find(stop_name)->second, &stop_name};
+	}
+	bool MarkOnRoute(Handle stop, uint64_t epoch) const {
+	  return stop.first->MarkOnRoute(epoch);
+	}
+	std::set<std::string>& GetBuses(Handle stop) const {
+	  return stop.first->GetBuses();
+	}
+	Coords GetCoords(Handle stop) const {
+	  return stop.first->GetCoords();
+	}
+	template <typename RouteKind>
+	double ComputeRoadDistance(Handle from, Handle to) const {
+	  return RouteKind::ComputeRoadDistance(*from.first, *to.first, *to.second, *from.second);
+	}
+
+	std::unordered_map<std::string, StopDataBase>& stop_db;
+  };
+
+  // The same over the dense stop layout: one name lookup per stop, then
+  // only id-indexed arrays.
+  struct LaidOutStops {
+	using Handle = uint32_t;
+
+	Handle Find(const std::string& stop_name) const {
+	  return layout.GetId(stop_name);
+	}
+	bool MarkOnRoute(Handle id, uint64_t epoch) const {
+	  return layout.MarkOnRoute(id, epoch);
+	}
+	std::set<std::string>& GetBuses(Handle id) const {
+	  return layout.GetStop(id).GetBuses();
+	}
+	Coords GetCoords(Handle id) const {
+	  return layout.GetCoords(id);
+	}
+	template <typename RouteKind>
+	double ComputeRoadDistance(Handle from, Handle to) const {
+	  return RouteKind::ComputeRoadDistance(layout, from, to);
+	}
+
+	StopLayout& layout;
+  };
+
+  template <typename RouteKind, typename Stops>
+  BusStats TraverseRoute(const std::string& bus_name, const std::vector<std::string>& stops,
+		  const Stops& stop_access) {
+	BusStats stats;
+	stats.stop_count = RouteKind::ComputeStopsOnRoute(stops.size());
+	stats.unique_stop_count = 0;
+	++route_epoch;
+	double route_distance = 0;
+	uint64_t real_route_distance = 0;
+	std::optional<typename Stops::Handle> prev_stop;
+	for(const std::string& stop_name: stops) {
+	  const typename Stops::Handle stop = stop_access.Find(stop_name);
+	  if(stop_access.MarkOnRoute(stop, route_epoch)) {
+		++stats.unique_stop_count;
+		stop_access.GetBuses(stop).insert(bus_name);
+	  }
+	  if(prev_stop) {
+		route_distance += RouteKind::GEO_FACTOR *
+				ComputeDistance(stop_access.GetCoords(*prev_stop), stop_access.GetCoords(stop));
+		real_route_distance += stop_access.template ComputeRoadDistance<RouteKind>(*prev_stop, stop);
+	  }
+	  prev_stop = stop;
+	}
+	stats.curvature = real_route_distance / route_distance;
+	stats.route_distance = real_route_distance;
+	return stats;
+  }
+
   std::unordered_map<std::string, BusStats> bus_stats;
   std::unordered_map<std::string, StopDataBase> stop_db;
-  Strategy* strategy;
+  uint64_t route_epoch = 0;
+  bool lookup_index_built = false;
+  FlatNameIndex<const BusStats*> bus_index;
+  FlatNameIndex<const StopDataBase*> stop_index;
+  StopLayout stop_layout;
 };
 //---------------------Business Logic of Programm----------------//
 
@@ -178,4 +386,7 @@ private:
 void TestComputeDistance();
 void TestBusStats();
 void TestStopStats();
+void TestLookupIndex();
+void TestStopLayout();
+void TestCompactStopLayout();
 //---------------------Tests-----------------------------------//
@@ -0,0 +1,40 @@
+#include "FlatIndex.h"
+#include <string>
+#include "test_runner.h"
+
+using namespace std;
+
+void TestFlatNameIndex() {
+  {
+	const FlatNameIndex<int> index;
+	ASSERT(!index.Find("750"));
+	ASSERT(!index.Find(""));
+  }
+  {
+	FlatNameIndex<int> index;
+	index.Build({});
+	ASSERT(!index.Find("750"));
+  }
+  {
+	vector<string> names;
+	for (int i = 0; i < 1000; ++i) {
+	  names.push_back("Stop " + to_string(i));
+	}
+	vector<pair<string_view, int>> entries;
+	for (size_t i = 0; i < names.size(); ++i) {
+	  entries.push_back({names[i], i});
+	}
+	FlatNameIndex<int> index;
+	index.Build(entries);
+	for (size_t i = 0; i < names.size(); ++i) {
+	  const string query = names[i];
+	  ASSERT(index.Find(query));
+	  ASSERT_EQUAL(*index.Find(query), static_cast<int>(i));
+	}
+	for (int i = 1000; i < 2000; ++i) {
+	  ASSERT(!index.Find("Stop " + to_string(i)));
+	}
+	ASSERT(!index.Find(""));
+	ASSERT(!index.Find("Stop"));
+  }
+}
@@ -35,3 +35,47 @@ void TestReadRequest() {
     vector<string>({"Tolstopaltsevo", "Marushkino", "Rasskazovka"}));
 
 }
+
+void TestReadAnalyticsRequest() {
+  stringstream ss("8\n"
+	"TopBuses curvature 10\n"
+	"BusesInRange length 1000 2500.5\n"
+	"BusyStops 2\n"
+	"LengthHistogram 500\n"
+	"TopBuses speed 3\n"
+	"TopBuses length -1\n"
+	"TopBuses length 2.5\n"
+	"BusyStops 99999999999999999999\n"
+  );
+  const auto requests = ReadRequests(ss, false);
+
+  ASSERT(static_cast<ReadTopBusesRequest&>(*requests[0]).metric == BusMetric::CURVATURE);
+  ASSERT_EQUAL(static_cast<ReadTopBusesRequest&>(*requests[0]).count, 10u);
+
+  ASSERT(static_cast<ReadBusesInRangeRequest&>(*requests[1]).metric == BusMetric::LENGTH);
+  ASSERT_EQUAL(static_cast<ReadBusesInRangeRequest&>(*requests[1]).from, 1000);
+  ASSERT_EQUAL(static_cast<ReadBusesInRangeRequest&>(*requests[1]).to, 2500.5);
+
+  ASSERT_EQUAL(static_cast<ReadBusyStopsRequest&>(*requests[2]).bus_count, 2u);
+  ASSERT_EQUAL(static_cast<ReadLengthHistogramRequest&>(*requests[3]).bucket_width, 500);
+  ASSERT(requests[4]->parse_error.has_value());
+  ASSERT(requests[5]->parse_error.has_value());
+  ASSERT(requests[6]->parse_error.has_value());
+  ASSERT(requests[7]->parse_error.has_value());
+}
+
+void TestReadReachableRequest() {
+  stringstream ss("4\n"
+	"Reachable 3 Biryulyovo Zapadnoye\n"
+	"Reachable -1 Biryulyovo Zapadnoye\n"
+	"ReachableCounts 2\n"
+	"ReachableCounts 2.5\n"
+  );
+  const auto requests = ReadRequests(ss, false);
+
+  ASSERT_EQUAL(static_cast<ReadReachableRequest&>(*requests[0]).max_buses, 3u);
+  ASSERT_EQUAL(static_cast<ReadReachableRequest&>(*requests[0]).stop_name, "Biryulyovo Zapadnoye");
+  ASSERT(requests[1]->parse_error.has_value());
+  ASSERT_EQUAL(static_cast<ReadReachableCountsRequest&>(*requests[2]).max_buses, 2u);
+  ASSERT(requests[3]->parse_error.has_value());
+}
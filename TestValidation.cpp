@@ -0,0 +1,47 @@
+#include "Validation.h"
+#include "test_runner.h"
+
+using namespace std;
+
+void TestValidation() {
+  stringstream ss("10\n"
+	"Stop A: 55.611087, 37.20829, 3900m to B\n"
+	"Stop B: 55.595884, 37.209755\n"
+	"Stop C: 55.632761, 37.3x\n"
+	"Stop D: 95.1, 37.333324, 0m to Nowhere\n"
+	"Bus 1: A - B\n"
+	"Bus 2: A > B > C > A\n"
+	"Bus 3: A > A\n"
+	"Bus 4: B > A > B\n"
+	"Stop E: 55.611087, 37.20829, 100m to D\n"
+	"Stop F: 55.611087, 37.20829, 100m to E\n"
+  );
+  const auto requests = ReadRequests(ss, true);
+  ASSERT_EQUAL(requests[0]->line_number, 2u);
+  ASSERT_EQUAL(requests[7]->line_number, 9u);
+  ASSERT(requests[2]->parse_error.has_value());
+
+  for (size_t thread_count: {1, 4}) {
+	const ValidationReport report = ValidateModifyRequests(requests, thread_count);
+	// E names the rejected D, and F names E
+	ASSERT_EQUAL(report.accepted, vector<char>({1, 1, 0, 0, 1, 0, 0, 1, 0, 0}));
+
+	vector<size_t> lines;
+	vector<Diagnostic::Kind> kinds;
+	for (const Diagnostic& diagnostic: report.diagnostics) {
+	  lines.push_back(diagnostic.line_number);
+	  kinds.push_back(diagnostic.kind);
+	}
+	ASSERT_EQUAL(lines, vector<size_t>({4, 5, 5, 5, 7, 8, 10, 11}));
+	ASSERT(kinds == vector<Diagnostic::Kind>({
+	  Diagnostic::Kind::PARSE_ERROR,
+	  Diagnostic::Kind::COORDS_OUT_OF_RANGE,
+	  Diagnostic::Kind::DISTANCE_OUT_OF_RANGE,
+	  Diagnostic::Kind::UNKNOWN_STOP,
+	  Diagnostic::Kind::UNKNOWN_STOP,
+	  Diagnostic::Kind::MISSING_DISTANCE,
+	  Diagnostic::Kind::UNKNOWN_STOP,
+	  Diagnostic::Kind::UNKNOWN_STOP,
+	}));
+  }
+}
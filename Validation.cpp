@@ -0,0 +1,279 @@
+#include "Validation.h"
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+namespace {
+
+const double MAX_LATITUDE = 90 * 3.1415926535 / 180;
+const double MAX_LONGITUDE = 180 * 3.1415926535 / 180;
+const double MAX_DISTANCE = 1000000;
+
+using Neighbours = unordered_map<string_view, unordered_set<string_view>>;
+
+string Quote(string_view name) {
+  return "\"" + string(name) + "\"";
+}
+
+double ToDegrees(double radians) {
+  return radians * 180 / 3.1415926535;
+}
+
+// Calls check(i, diagnostics) for every i in [0, items_count), splitting the
+// range between thread_count workers. check must only touch per-item state.
+template <typename Check>
+void RunInParallel(size_t items_count, size_t thread_count, const Check& check,
+		vector<Diagnostic>& diagnostics) {
+  if (items_count == 0) {
+	return;
+  }
+  thread_count = max<size_t>(1, min(thread_count, items_count));
+  const size_t chunk_size = (items_count + thread_count - 1) / thread_count;
+
+  vector<future<vector<Diagnostic>>> futures;
+  for (size_t first = 0; first < items_count; first += chunk_size) {
+	const size_t last = min(items_count, first + chunk_size);
+	futures.push_back(async(launch::async, [first, last, &check] {
+	  vector<Diagnostic> result;
+	  for (size_t i = first; i < last; ++i) {
+		check(i, result);
+	  }
+	  return result;
+	}));
+  }
+  for (auto& f: futures) {
+	vector<Diagnostic> part = f.get();
+	move(begin(part), end(part), back_inserter(diagnostics));
+  }
+}
+
+bool CheckStop(const ModifyStopRequest& request,
+		const unordered_set<string_view>& defined_stops,
+		vector<Diagnostic>& diagnostics) {
+  bool ok = CheckStopRanges(request, diagnostics);
+  for (const DistanceToStop& dist: request.distances) {
+	if (!defined_stops.count(dist.stop_name)) {
+	  diagnostics.push_back({request.line_number, Diagnostic::Kind::UNKNOWN_STOP,
+		  "stop " + Quote(dist.stop_name) + " is not defined"});
+	  ok = false;
+	}
+  }
+  return ok;
+}
+
+bool CheckBus(const ModifyBusRequest& request, const Neighbours& accepted_stops,
+		vector<Diagnostic>& diagnostics) {
+  if (request.stops.empty()) {
+	diagnostics.push_back({request.line_number, Diagnostic::Kind::EMPTY_ROUTE,
+		"bus " + Quote(request.bus_name) + " has no stops"});
+	return false;
+  }
+  bool ok = true;
+  const unordered_set<string_view>* prev_neighbours = nullptr;
+  for (size_t i = 0; i < request.stops.size(); ++i) {
+	const string& stop_name = request.stops[i];
+	const auto it = accepted_stops.find(stop_name);
+	if (it == accepted_stops.end()) {
+	  diagnostics.push_back({request.line_number, Diagnostic::Kind::UNKNOWN_STOP,
+		  "stop " + Quote(stop_name) + " is not defined"});
+	  ok = false;
+	} else if (prev_neighbours && !prev_neighbours->count(stop_name)) {
+	  diagnostics.push_back({request.line_number, Diagnostic::Kind::MISSING_DISTANCE,
+		  "no road distance between " + Quote(request.stops[i - 1]) +
+		  " and " + Quote(stop_name)});
+	  ok = false;
+	}
+	prev_neighbours = it == accepted_stops.end() ? nullptr : &it->second;
+  }
+  return ok;
+}
+
+// A road distance to a stop left without an accepted definition would
+// create that stop with no coordinates, so the stop naming it is rejected
+// too, and so on along the chain.
+void RejectStopsNamingRejected(const vector<RequestHolder>& requests,
+		const vector<size_t>& stop_indices, ValidationReport& report) {
+  unordered_map<string_view, size_t> accepted_counts;
+  unordered_map<string_view, vector<size_t>> referrers;
+  for (size_t index: stop_indices) {
+	const auto& request = static_cast<const ModifyStopRequest&>(*requests[index]);
+	accepted_counts[request.stop_name] += report.accepted[index];
+	for (const DistanceToStop& dist: request.distances) {
+	  referrers[dist.stop_name].push_back(index);
+	}
+  }
+  // in request order, so the reason given for each stop does not depend
+  // on hashing
+  vector<string_view> rejected_names;
+  for (size_t index: stop_indices) {
+	const string& stop_name = static_cast<const ModifyStopRequest&>(*requests[index]).stop_name;
+	if (!report.accepted[index] && accepted_counts[stop_name] == 0) {
+	  accepted_counts[stop_name] = numeric_limits<size_t>::max();
+	  rejected_names.push_back(stop_name);
+	}
+  }
+  for (size_t i = 0; i < rejected_names.size(); ++i) {
+	for (size_t index: referrers[rejected_names[i]]) {
+	  if (!report.accepted[index]) {
+		continue;
+	  }
+	  const auto& request = static_cast<const ModifyStopRequest&>(*requests[index]);
+	  report.accepted[index] = false;
+	  report.diagnostics.push_back({request.line_number, Diagnostic::Kind::UNKNOWN_STOP,
+		  "stop " + Quote(rejected_names[i]) + " is rejected"});
+	  if (--accepted_counts[request.stop_name] == 0) {
+		accepted_counts[request.stop_name] = numeric_limits<size_t>::max();
+		rejected_names.push_back(request.stop_name);
+	  }
+	}
+  }
+}
+
+}
+
+bool CheckStopRanges(const ModifyStopRequest& request, vector<Diagnostic>& diagnostics) {
+  bool ok = true;
+  if (!(abs(request.latitude) <= MAX_LATITUDE) ||
+	  !(abs(request.longitude) <= MAX_LONGITUDE)) {
+	ostringstream message;
+	message << "coordinates " << ToDegrees(request.latitude) << ", "
+			<< ToDegrees(request.longitude) << " of stop " << Quote(request.stop_name)
+			<< " are out of range";
+	diagnostics.push_back({request.line_number, Diagnostic::Kind::COORDS_OUT_OF_RANGE,
+		message.str()});
+	ok = false;
+  }
+  for (const DistanceToStop& dist: request.distances) {
+	if (!(dist.distance > 0 && dist.distance <= MAX_DISTANCE)) {
+	  ostringstream message;
+	  message << "distance " << dist.distance << "m to " << Quote(dist.stop_name)
+			  << " is out of range (0, " << MAX_DISTANCE << "]";
+	  diagnostics.push_back({request.line_number, Diagnostic::Kind::DISTANCE_OUT_OF_RANGE,
+		  message.str()});
+	  ok = false;
+	}
+  }
+  return ok;
+}
+
+ValidationReport ValidateModifyRequests(const vector<RequestHolder>& requests,
+		size_t thread_count) {
+  ValidationReport report;
+  report.accepted.assign(requests.size(), false);
+
+  vector<size_t> stop_indices, bus_indices;
+  unordered_set<string_view> defined_stops;
+  for (size_t i = 0; i < requests.size(); ++i) {
+	const Request& request = *requests[i];
+	if (request.parse_error) {
+	  report.diagnostics.push_back({request.line_number, Diagnostic::Kind::PARSE_ERROR,
+		  *request.parse_error});
+	} else if (request.type == Request::Type::MODIFY_STOP) {
+	  stop_indices.push_back(i);
+	  defined_stops.insert(static_cast<const ModifyStopRequest&>(request).stop_name);
+	} else if (request.type == Request::Type::MODIFY_BUS) {
+	  bus_indices.push_back(i);
+	}
+  }
+
+  RunInParallel(stop_indices.size(), thread_count,
+	  [&](size_t i, vector<Diagnostic>& diagnostics) {
+	const size_t index = stop_indices[i];
+	report.accepted[index] = CheckStop(static_cast<const ModifyStopRequest&>(*requests[index]),
+		defined_stops, diagnostics);
+  }, report.diagnostics);
+  RejectStopsNamingRejected(requests, stop_indices, report);
+
+  // Road distances are symmetric unless given explicitly in both directions,
+  // so an edge listed by either end serves both directions of a route.
+  Neighbours accepted_stops;
+  unordered_set<string_view> accepted_names;
+  for (size_t index: stop_indices) {
+	if (!report.accepted[index]) {
+	  continue;
+	}
+	const auto& request = static_cast<const ModifyStopRequest&>(*requests[index]);
+	accepted_names.insert(request.stop_name);
+	accepted_stops[request.stop_name];
+	for (const DistanceToStop& dist: request.distances) {
+	  accepted_stops[request.stop_name].insert(dist.stop_name);
+	  accepted_stops[dist.stop_name].insert(request.stop_name);
+	}
+  }
+  // Only stops that are themselves accepted may be used on routes.
+  for (auto it = begin(accepted_stops); it != end(accepted_stops);) {
+	it = accepted_names.count(it->first) ? next(it) : accepted_stops.erase(it);
+  }
+
+  RunInParallel(bus_indices.size(), thread_count,
+	  [&](size_t i, vector<Diagnostic>& diagnostics) {
+	const size_t index = bus_indices[i];
+	report.accepted[index] = CheckBus(static_cast<const ModifyBusRequest&>(*requests[index]),
+		accepted_stops, diagnostics);
+  }, report.diagnostics);
+
+  stable_sort(begin(report.diagnostics), end(report.diagnostics),
+	  [](const Diagnostic& lhs, const Diagnostic& rhs) {
+	return lhs.line_number < rhs.line_number;
+  });
+  // A request naming the same undefined stop twice, or the same pair of
+  // stops without a distance, gets the diagnostic once.
+  vector<Diagnostic> unique_diagnostics;
+  unordered_set<string> line_messages;
+  for (Diagnostic& diagnostic: report.diagnostics) {
+	if (!unique_diagnostics.empty() &&
+		diagnostic.line_number != unique_diagnostics.back().line_number) {
+	  line_messages.clear();
+	}
+	if (line_messages.insert(diagnostic.message).second) {
+	  unique_diagnostics.push_back(move(diagnostic));
+	}
+  }
+  report.diagnostics = move(unique_diagnostics);
+  return report;
+}
+
+optional<ValidationPolicy> ConvertValidationPolicyFromString(string_view policy_str) {
+  if (policy_str == "strict") {
+	return ValidationPolicy::STRICT;
+  } else if (policy_str == "skip") {
+	return ValidationPolicy::SKIP;
+  }
+  return nullopt;
+}
+
+string_view ConvertDiagnosticKindToString(Diagnostic::Kind kind) {
+  switch (kind) {
+	case Diagnostic::Kind::PARSE_ERROR:
+	  return "parse error";
+	case Diagnostic::Kind::UNKNOWN_STOP:
+	  return "unknown stop";
+	case Diagnostic::Kind::MISSING_DISTANCE:
+	  return "missing distance";
+	case Diagnostic::Kind::COORDS_OUT_OF_RANGE:
+	  return "coordinates out of range";
+	case Diagnostic::Kind::DISTANCE_OUT_OF_RANGE:
+	  return "distance out of range";
+	case Diagnostic::Kind::EMPTY_ROUTE:
+	  return "empty route";
+	default:
+	  return "unknown";
+  }
+}
+
+void PrintValidationReport(const ValidationReport& report, ostream& stream) {
+  PrintDiagnostics(report.diagnostics, stream);
+}
+
+void PrintDiagnostics(const vector<Diagnostic>& diagnostics, ostream& stream) {
+  for (const Diagnostic& diagnostic: diagnostics) {
+	stream << "line " << diagnostic.line_number << ": "
+		   << ConvertDiagnosticKindToString(diagnostic.kind) << ": "
+		   << diagnostic.message << '\n';
+  }
+}
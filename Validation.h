@@ -0,0 +1,69 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Requests.h"
+
+//------------------Validation------------------------------------//
+
+enum class ValidationPolicy {
+  STRICT,
+  SKIP,
+};
+
+struct Diagnostic {
+  enum class Kind {
+	PARSE_ERROR,
+	UNKNOWN_STOP,
+	MISSING_DISTANCE,
+	COORDS_OUT_OF_RANGE,
+	DISTANCE_OUT_OF_RANGE,
+	EMPTY_ROUTE,
+  };
+
+  size_t line_number;
+  Kind kind;
+  std::string message;
+};
+
+struct ValidationReport {
+  bool HasErrors() const {
+	return !diagnostics.empty();
+  }
+
+  bool IsAccepted(size_t request_index) const {
+	return accepted[request_index];
+  }
+
+  // Sorted by line number.
+  std::vector<Diagnostic> diagnostics;
+  std::vector<char> accepted;
+};
+
+// Checks a parsed modify batch before it reaches RouteManager: every
+// referenced stop exists, every pair of neighbouring stops on a route has
+// a road distance, coordinates and distances are in range. A rejected stop
+// also rejects the buses that go through it and the stops that give a
+// road distance to it. Stops are checked first and buses second, each
+// phase split between thread_count workers. Identical diagnostics of one
+// request are reported once.
+ValidationReport ValidateModifyRequests(const std::vector<RequestHolder>& requests,
+		size_t thread_count);
+
+// The checks of a single stop that need no other requests: coordinates
+// and distances are in range.
+bool CheckStopRanges(const ModifyStopRequest& request, std::vector<Diagnostic>& diagnostics);
+
+std::optional<ValidationPolicy> ConvertValidationPolicyFromString(std::string_view policy_str);
+
+std::string_view ConvertDiagnosticKindToString(Diagnostic::Kind kind);
+
+void PrintValidationReport(const ValidationReport& report, std::ostream& stream);
+
+void PrintDiagnostics(const std::vector<Diagnostic>& diagnostics, std::ostream& stream);
+
+//------------------Validation------------------------------------//
+
+//-------------------------Tests--------------------------------//
+void TestValidation();
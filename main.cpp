@@ -1,47 +1,421 @@
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <thread>
 #include "Requests.h"
 #include "test_runner.h"
 #include "RouteManager.h"
+#include "Validation.h"
+#include "Analytics.h"
+#include "ExternalBuild.h"
+#include "Reachability.h"
+#include "Daemon.h"
+#include "Gtfs.h"
+#include "Render.h"
 
 using namespace std;
 
 void TestAll() {
   TestRunner tr;
   RUN_TEST(tr, TestReadRequest);
+  RUN_TEST(tr, TestReadAnalyticsRequest);
+  RUN_TEST(tr, TestReadReachableRequest);
   RUN_TEST(tr, TestComputeDistance);
   RUN_TEST(tr, TestBusStats);
   RUN_TEST(tr, TestStopStats);
+  RUN_TEST(tr, TestLookupIndex);
+  RUN_TEST(tr, TestStopLayout);
+  RUN_TEST(tr, TestCompactStopLayout);
+  RUN_TEST(tr, TestValidation);
+  RUN_TEST(tr, TestStatsIndex);
+  RUN_TEST(tr, TestReachability);
+  RUN_TEST(tr, TestFlatNameIndex);
+  RUN_TEST(tr, TestCsvScanner);
 }
 
-void ModifyProcessing(const Visitor& visitor, const vector<RequestHolder>& requests) {
-  for(const RequestHolder& r: requests) {
-    if(r->type == Request::Type::MODIFY_STOP) {
-	  r->Accept(visitor);
+// Tests that need sockets or the file system; they run only with
+// --self-test, so a restricted environment cannot stop the program.
+void TestSystem() {
+  TestRunner tr;
+  RUN_TEST(tr, TestExternalSorter);
+  RUN_TEST(tr, TestExternalRouteDataBase);
+  RUN_TEST(tr, TestExternalRepeatedDefinitions);
+  RUN_TEST(tr, TestGtfsImport);
+  RUN_TEST(tr, TestMapRenderer);
+  RUN_TEST(tr, TestDaemon);
+}
+
+struct Options {
+  ValidationPolicy validation_policy = ValidationPolicy::STRICT;
+  size_t thread_count = max(1u, thread::hardware_concurrency());
+  bool external_memory = false;
+  bool locality_layout = false;
+  bool compact_layout = false;
+  optional<filesystem::path> gtfs_dir;
+  optional<TileRenderOptions> render_tiles;
+  ExternalBuildOptions external_build;
+  enum class Mode {BATCH, DAEMON, CLIENT, LOAD, SELF_TEST} mode = Mode::BATCH;
+  DaemonOptions daemon;
+  bool serve_analytics = false;
+  bool serve_reachable = false;
+  LoadOptions load;
+};
+
+// Reads a whole unsigned number, returning false for anything else.
+bool ReadUnsigned(string_view value, size_t& number) {
+  try {
+	number = ConvertToUnsigned(value);
+  } catch (const exception&) {
+	return false;
+  }
+  return true;
+}
+
+// Reads a count that must be at least one.
+bool ReadCount(string_view value, size_t& count) {
+  return ReadUnsigned(value, count) && count > 0;
+}
+
+// Accepts a plain byte count or one with a K, M or G suffix.
+optional<size_t> ConvertByteSizeFromString(string_view size_str) {
+  size_t multiplier = 1;
+  if (!size_str.empty()) {
+	switch (size_str.back()) {
+	  case 'K': multiplier = 1ull << 10; break;
+	  case 'M': multiplier = 1ull << 20; break;
+	  case 'G': multiplier = 1ull << 30; break;
 	}
   }
-  for(const RequestHolder& r: requests) {
-	if(r->type == Request::Type::MODIFY_BUS) {
-	  r->Accept(visitor);
+  if (multiplier != 1) {
+	size_str.remove_suffix(1);
+  }
+  size_t size;
+  if (!ReadUnsigned(size_str, size) || size > numeric_limits<size_t>::max() / multiplier) {
+	return nullopt;
+  }
+  return size * multiplier;
+}
+
+optional<Options> ParseOptions(int argc, char* argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+	auto [name, value] = SplitTwo(argv[i], "=");
+	if (name == "--validation") {
+	  const auto policy = ConvertValidationPolicyFromString(value);
+	  if (!policy) {
+		return nullopt;
+	  }
+	  options.validation_policy = *policy;
+	} else if (name == "--threads") {
+	  if (!ReadCount(value, options.thread_count)) {
+		return nullopt;
+	  }
+	} else if (name == "--external-memory") {
+	  const auto memory_limit = ConvertByteSizeFromString(value);
+	  if (!memory_limit) {
+		return nullopt;
+	  }
+	  options.external_memory = true;
+	  options.external_build.memory_limit = *memory_limit;
+	} else if (name == "--temp-dir") {
+	  options.external_build.temp_dir = string(value);
+	} else if (name == "--locality" && value.empty()) {
+	  options.locality_layout = true;
+	} else if (name == "--compact" && value.empty()) {
+	  options.compact_layout = true;
+	} else if (name == "--gtfs") {
+	  options.gtfs_dir = string(value);
+	} else if (name == "--render-tiles") {
+	  if (!options.render_tiles) {
+		options.render_tiles.emplace();
+	  }
+	  options.render_tiles->dir = string(value);
+	} else if (name == "--tile-zoom") {
+	  if (!options.render_tiles) {
+		options.render_tiles.emplace();
+	  }
+	  const auto [min_zoom_str, max_zoom_str] = SplitTwo(value, "-");
+	  size_t min_zoom, max_zoom;
+	  if (!ReadUnsigned(min_zoom_str, min_zoom) || !ReadUnsigned(max_zoom_str, max_zoom)
+		  || max_zoom > 24 || min_zoom > max_zoom) {
+		return nullopt;
+	  }
+	  options.render_tiles->min_zoom = min_zoom;
+	  options.render_tiles->max_zoom = max_zoom;
+	} else if (name == "--daemon") {
+	  options.mode = Options::Mode::DAEMON;
+	  options.daemon.socket_path = string(value);
+	} else if (name == "--serve-analytics" && value.empty()) {
+	  options.serve_analytics = true;
+	} else if (name == "--serve-reachable" && value.empty()) {
+	  options.serve_reachable = true;
+	} else if (name == "--self-test" && value.empty()) {
+	  options.mode = Options::Mode::SELF_TEST;
+	} else if (name == "--workers") {
+	  if (!ReadCount(value, options.daemon.worker_count)) {
+		return nullopt;
+	  }
+	} else if (name == "--client") {
+	  options.mode = Options::Mode::CLIENT;
+	  options.load.socket_path = string(value);
+	} else if (name == "--load") {
+	  options.mode = Options::Mode::LOAD;
+	  options.load.socket_path = string(value);
+	} else if (name == "--connections") {
+	  if (!ReadCount(value, options.load.connections)) {
+		return nullopt;
+	  }
+	} else if (name == "--requests") {
+	  if (!ReadCount(value, options.load.requests_per_connection)) {
+		return nullopt;
+	  }
+	} else if (name == "--pipeline") {
+	  if (!ReadCount(value, options.load.pipeline_depth)) {
+		return nullopt;
+	  }
+	} else {
+	  return nullopt;
+	}
+  }
+  if (options.render_tiles && (options.render_tiles->dir.empty() || options.gtfs_dir)) {
+	return nullopt;
+  }
+  // the external build keeps no stop layout
+  if (options.external_memory && (options.compact_layout || options.locality_layout)) {
+	return nullopt;
+  }
+  return options;
+}
+
+// Orders buses by the layout id of their first stop, so routes starting
+// in the same area are traversed one after another. All occurrences of
+// a bus name share the key of its last one and keep their relative order.
+void OrderBusesByLocality(const StopLayout& layout, vector<const ModifyBusRequest*>& buses) {
+  vector<uint32_t> keys(buses.size());
+  unordered_map<string_view, uint32_t> last_keys;
+  for (size_t i = 0; i < buses.size(); ++i) {
+	keys[i] = layout.GetId(buses[i]->stops.front());
+	last_keys[buses[i]->bus_name] = keys[i];
+  }
+  vector<size_t> order(buses.size());
+  for (size_t i = 0; i < buses.size(); ++i) {
+	order[i] = i;
+	keys[i] = last_keys[buses[i]->bus_name];
+  }
+  stable_sort(begin(order), end(order), [&keys](size_t lhs, size_t rhs) {
+	return keys[lhs] < keys[rhs];
+  });
+  vector<const ModifyBusRequest*> ordered;
+  ordered.reserve(buses.size());
+  for (size_t i: order) {
+	ordered.push_back(buses[i]);
+  }
+  buses = move(ordered);
+}
+
+void ModifyProcessing(const Visitor& visitor, RouteManager& rm,
+		const vector<RequestHolder>& requests, const ValidationReport& report,
+		bool locality_layout, bool compact_layout) {
+  vector<const ModifyBusRequest*> buses;
+  for(size_t i = 0; i < requests.size(); ++i) {
+    if(requests[i]->type == Request::Type::MODIFY_STOP && report.IsAccepted(i)) {
+	  requests[i]->Accept(visitor);
+	} else if(requests[i]->type == Request::Type::MODIFY_BUS && report.IsAccepted(i)) {
+	  buses.push_back(static_cast<const ModifyBusRequest*>(requests[i].get()));
 	}
   }
+  if(locality_layout || compact_layout) {
+	rm.BuildStopLayout(compact_layout);
+  }
+  if(locality_layout) {
+	OrderBusesByLocality(rm.GetStopLayout(), buses);
+  }
+  for(const ModifyBusRequest* bus: buses) {
+	bus->Accept(visitor);
+  }
+}
+
+// Draws the stops and the accepted buses of the modify batch, each bus
+// along the stops of its last accepted request.
+int RenderMap(const RouteManager& rm, const vector<RequestHolder>& requests,
+		const ValidationReport& report, TileRenderOptions options, size_t thread_count) {
+  MapRenderer renderer;
+  vector<pair<string_view, Coords>> stops;
+  for (const auto& [stop_name, stop]: rm.GetStopDataBase()) {
+	stops.push_back({stop_name, stop.GetCoords()});
+  }
+  sort(begin(stops), end(stops), [](const auto& lhs, const auto& rhs) {
+	return lhs.first < rhs.first;
+  });
+  for (const auto& [stop_name, coords]: stops) {
+	renderer.AddStop(string(stop_name), coords);
+  }
+  unordered_map<string_view, const ModifyBusRequest*> buses;
+  vector<string_view> bus_names;
+  for(size_t i = 0; i < requests.size(); ++i) {
+	if(requests[i]->type == Request::Type::MODIFY_BUS && report.IsAccepted(i)) {
+	  const auto& bus = static_cast<const ModifyBusRequest&>(*requests[i]);
+	  if (!buses.count(bus.bus_name)) {
+		bus_names.push_back(bus.bus_name);
+	  }
+	  buses[bus.bus_name] = &bus;
+	}
+  }
+  for (string_view bus_name: bus_names) {
+	renderer.AddBus(buses[bus_name]->bus_name, buses[bus_name]->stops);
+  }
+  options.thread_count = thread_count;
+  try {
+	PrintTileRenderStats(renderer.RenderTiles(options), cerr);
+  } catch (const exception& e) {
+	cerr << "tiles: " << e.what() << '\n';
+	return 1;
+  }
+  return 0;
+}
+
+void PrintReadError(const Request& request, string_view message) {
+  cerr << "line " << request.line_number << ": " << message << '\n';
 }
 
 void ReadProcessing(const Visitor& visitor, const vector<RequestHolder>& requests) {
   for(const RequestHolder& r: requests) {
+	if(r->parse_error) {
+	  PrintReadError(*r, "parse error: " + *r->parse_error);
+	  continue;
+	}
 	r->Accept(visitor);
   }
 }
 
-int main() {
+void ExternalReadProcessing(const ExternalRouteDataBase& db,
+		const vector<RequestHolder>& requests) {
+  for(const RequestHolder& r: requests) {
+	if(r->parse_error) {
+	  PrintReadError(*r, "parse error: " + *r->parse_error);
+	} else if(r->type == Request::Type::READ_BUS) {
+	  const string& bus_name = static_cast<const ReadBusRequest&>(*r).bus_name;
+	  PrintRouteResponse(bus_name, db.GetBusStats(bus_name), cout);
+	} else if(r->type == Request::Type::READ_STOP) {
+	  const string& stop_name = static_cast<const ReadStopRequest&>(*r).stop_name;
+	  const auto buses = db.GetStopStats(stop_name);
+	  PrintStopResponse(stop_name, buses ? &*buses : nullptr, cout);
+	} else {
+	  PrintReadError(*r, "request is not supported in external memory mode");
+	}
+  }
+}
+
+int ExternalMain(const Options& options) {
+  size_t line_number = 0;
+  const ExternalRouteDataBase db(cin, options.external_build, line_number);
+  db.PrintDiagnostics(cerr);
+  if (db.GetDiagnosticsCount() > 0 && options.validation_policy == ValidationPolicy::STRICT) {
+	return 1;
+  }
+  const auto read_requests = ReadRequests(cin, false, line_number);
+  ExternalReadProcessing(db, read_requests);
+  return 0;
+}
+
+int DaemonMain(const Options& options, const Visitor& visitor) {
+  try {
+	RunDaemon(visitor, options.daemon);
+  } catch (const exception& e) {
+	cerr << "daemon: " << e.what() << '\n';
+	return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  const auto options = ParseOptions(argc, argv);
+  if (!options) {
+	cerr << "usage: " << argv[0] << " [--validation=strict|skip] [--threads=N] [--locality]"
+		 << " [--compact] [--external-memory=BYTES[K|M|G]] [--temp-dir=PATH] [--gtfs=DIR]"
+		 << " [--render-tiles=DIR [--tile-zoom=MIN-MAX]]"
+		 << " [--daemon=SOCKET [--workers=N] [--serve-analytics] [--serve-reachable]]"
+		 << " [--client=SOCKET]"
+		 << " [--load=SOCKET [--connections=N] [--requests=N] [--pipeline=N]]\n";
+	return 2;
+  }
+  if (options->mode == Options::Mode::CLIENT) {
+	return RunClient(options->load.socket_path, cin, cout) ? 0 : 1;
+  }
+  if (options->mode == Options::Mode::LOAD) {
+	return RunLoadGenerator(options->load, cin, cout) ? 0 : 1;
+  }
   TestAll();
+  if (options->mode == Options::Mode::SELF_TEST) {
+	TestSystem();
+	return 0;
+  }
+  cout.precision(6);
+  if (options->external_memory) {
+	return ExternalMain(*options);
+  }
 
   RouteManager rm;
   Visitor visitor;
   visitor.SetRouteManager(&rm);
-  cout.precision(6);
-  const auto modify_requests = ReadRequests(cin, true);
-  ModifyProcessing(visitor, modify_requests);
-  const auto read_requests = ReadRequests(cin, false);
+  size_t line_number = 0;
+  if (options->gtfs_dir) {
+	// the feed replaces the modify batch, stdin holds only read requests
+	try {
+	  PrintGtfsImportStats(ImportGtfsFeed(*options->gtfs_dir, rm,
+		  {options->thread_count, options->locality_layout, options->compact_layout}), cerr);
+	} catch (const exception& e) {
+	  cerr << "gtfs: " << e.what() << '\n';
+	  return 1;
+	}
+  } else {
+	const auto modify_requests = ReadRequests(cin, true, line_number);
+	const auto report = ValidateModifyRequests(modify_requests, options->thread_count);
+	PrintValidationReport(report, cerr);
+	if (report.HasErrors() && options->validation_policy == ValidationPolicy::STRICT) {
+	  return 1;
+	}
+	ModifyProcessing(visitor, rm, modify_requests, report, options->locality_layout,
+		options->compact_layout);
+	if (options->render_tiles && RenderMap(rm, modify_requests, report,
+		*options->render_tiles, options->thread_count) != 0) {
+	  return 1;
+	}
+  }
+  rm.BuildLookupIndex();
+  if (options->mode == Options::Mode::DAEMON) {
+	// read requests come from clients, so the indexes asked for are built
+	// up front and requests needing the others are answered with an error
+	optional<StatsIndex> stats_index;
+	optional<ReachabilityIndex> reachability_index;
+	if (options->serve_analytics) {
+	  stats_index.emplace(rm, options->thread_count);
+	  visitor.SetStatsIndex(&*stats_index);
+	}
+	if (options->serve_reachable) {
+	  reachability_index.emplace(rm, options->thread_count);
+	  visitor.SetReachabilityIndex(&*reachability_index);
+	}
+	return DaemonMain(*options, visitor);
+  }
+  const auto read_requests = ReadRequests(cin, false, line_number);
+
+  // the indexes are only built when a request needs them; bus masks take
+  // stops * buses bits
+  optional<StatsIndex> stats_index;
+  if (any_of(begin(read_requests), end(read_requests), [](const RequestHolder& r) {
+	return NeedsStatsIndex(r->type);
+  })) {
+	stats_index.emplace(rm, options->thread_count);
+	visitor.SetStatsIndex(&*stats_index);
+  }
+  optional<ReachabilityIndex> reachability_index;
+  if (any_of(begin(read_requests), end(read_requests), [](const RequestHolder& r) {
+	return NeedsReachabilityIndex(r->type);
+  })) {
+	reachability_index.emplace(rm, options->thread_count);
+	visitor.SetReachabilityIndex(&*reachability_index);
+  }
   ReadProcessing(visitor, read_requests);
   return 0;
 }